@@ -0,0 +1,44 @@
+#ifndef _BENCH_UTIL_H_
+#define _BENCH_UTIL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Helpers shared by implicit-bench, implicit-stress and implicit-compare,
+ * so that their seeded workloads draw the same sequences.
+ */
+
+/*
+ * Initial state of the random number generator for a seed.
+ */
+static inline uint64_t rng_init(uint64_t seed)
+{
+  return seed ? seed : 1;
+}
+
+/*
+ * Small deterministic random number generator (xorshift64).
+ */
+static inline uint64_t rng_next(uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/*
+ * Same distribution as get_rand_block_size in implicit-test.c.
+ */
+static inline size_t rand_block_size(uint64_t *state)
+{
+  size_t size = 4;
+  while (size < 512 && rng_next(state) % 6 != 0)
+    size <<= 1;
+  while (size < 2048 && rng_next(state) % 2 != 0)
+    size <<= 1;
+  return size + rng_next(state) % size;
+}
+
+#endif
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "implicit.h"
+
+/*
+ * Default number of cells in the occupancy map, and cells per line.
+ */
+#define DEFAULT_CELLS 1024
+#define CELLS_PER_LINE 64
+
+/*
+ * Print how to invoke the tool.
+ */
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-c cells] [snapshot-file]\n", prog);
+  fprintf(stderr, "Reads stdin when no snapshot file is given.\n");
+}
+
+/*
+ * Add the bytes of run that fall into each cell of the map. used[] and
+ * covered[] count bytes per cell.
+ */
+static void add_run(heap_snapshot_run *run, uint64_t heap_size, int cells,
+		    uint64_t *used, uint64_t *covered)
+{
+  uint64_t start = run->offset;
+  uint64_t end = run->offset + run->size;
+  if (end > heap_size)
+    end = heap_size;
+
+  while (start < end) {
+    int cell = (int) ((start * cells) / heap_size);
+    uint64_t cell_end = ((uint64_t) (cell + 1) * heap_size + cells - 1) / cells;
+    if (cell_end > end)
+      cell_end = end;
+    if (cell_end <= start)
+      cell_end = start + 1;
+    covered[cell] += cell_end - start;
+    if (run->in_use)
+      used[cell] += cell_end - start;
+    start = cell_end;
+  }
+}
+
+/*
+ * Render a heap snapshot produced by heap_snapshot as an occupancy map:
+ * '#' cells are fully in use, '.' cells fully free, '+' cells mixed, and
+ * ' ' cells are not covered by any block.
+ */
+int main(int argc, char *argv[])
+{
+  int cells = DEFAULT_CELLS;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:h")) != -1) {
+    switch (opt) {
+    case 'c':
+      cells = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (cells <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  FILE *in = stdin;
+  if (optind < argc) {
+    in = fopen(argv[optind], "rb");
+    if (in == NULL) {
+      perror(argv[optind]);
+      return 1;
+    }
+  }
+
+  heap_snapshot_header hdr;
+  if (fread(&hdr, sizeof(hdr), 1, in) != 1
+      || hdr.magic != HEAP_SNAPSHOT_MAGIC
+      || hdr.version != HEAP_SNAPSHOT_VERSION
+      || hdr.heap_size == 0) {
+    fprintf(stderr, "not a heap snapshot\n");
+    return 1;
+  }
+  if ((uint64_t) cells > hdr.heap_size)
+    cells = (int) hdr.heap_size;
+
+  uint64_t *used = calloc(cells, sizeof(uint64_t));
+  uint64_t *covered = calloc(cells, sizeof(uint64_t));
+  if (used == NULL || covered == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  heap_snapshot_run run;
+  uint64_t runs = 0, blocks = 0, used_bytes = 0, free_bytes = 0;
+  uint64_t free_runs = 0, largest_free = 0;
+  while (fread(&run, sizeof(run), 1, in) == 1) {
+    runs++;
+    blocks += run.blocks;
+    if (run.in_use) {
+      used_bytes += run.size;
+    }
+    else {
+      free_bytes += run.size;
+      free_runs++;
+      if (run.size > largest_free)
+	largest_free = run.size;
+    }
+    add_run(&run, hdr.heap_size, cells, used, covered);
+  }
+
+  printf("Heap size: %" PRIu64 " bytes, %" PRIu64 " blocks in %" PRIu64 " runs\n",
+	 hdr.heap_size, blocks, runs);
+  printf("In use: %" PRIu64 " bytes, free: %" PRIu64 " bytes in %" PRIu64 " runs\n",
+	 used_bytes, free_bytes, free_runs);
+  printf("Largest free run: %" PRIu64 " bytes, average: %" PRIu64 " bytes\n",
+	 largest_free, free_runs ? free_bytes / free_runs : 0);
+  printf("Each cell is ~%" PRIu64 " bytes ('#' used, '.' free, '+' mixed)\n",
+	 (hdr.heap_size + cells - 1) / cells);
+
+  int i;
+  for (i = 0; i < cells; i++) {
+    char c;
+    if (covered[i] == 0)
+      c = ' ';
+    else if (used[i] == 0)
+      c = '.';
+    else if (used[i] == covered[i])
+      c = '#';
+    else
+      c = '+';
+    putchar(c);
+    if ((i + 1) % CELLS_PER_LINE == 0 || i == cells - 1)
+      putchar('\n');
+  }
+
+  free(used);
+  free(covered);
+  if (in != stdin)
+    fclose(in);
+  return 0;
+}
@@ -0,0 +1,570 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "implicit.h"
+#include "bench-util.h"
+
+/*
+ * Adapters from the typed heaps of a specialized allocator to the untyped
+ * interface of bench_allocator.
+ */
+#define BENCH_SPEC_ADAPTERS(name)					\
+  static void *name##_bench_create(intptr_t size)			\
+  { return name##_create(size); }					\
+  static void name##_bench_destroy(void *h)				\
+  { name##_destroy(h); }						\
+  static void *name##_bench_malloc(void *h, size_t size)		\
+  { return name##_malloc(h, size); }					\
+  static void name##_bench_free(void *h, void *payload)			\
+  { name##_free(h, payload); }						\
+  static unsigned long name##_bench_avg_free(void *h)			\
+  { return name##_avg_free_block_size(h); }
+
+/*
+ * Entries of bench_allocator for a specialized allocator.
+ */
+#define BENCH_SPEC(name) name##_bench_create, name##_bench_destroy,	\
+    name##_bench_malloc, name##_bench_free, name##_bench_avg_free
+
+/*
+ * Allocators generated for the same policies and layout as the generic
+ * heap, to measure the cost of runtime dispatch.
+ */
+#define SPEC_NAME spec_first
+#define SPEC_FIT HEAP_FIRSTFIT
+#define SPEC_TAG block_size_t
+#define SPEC_ALIGN PAYLOAD_ALIGN
+#define SPEC_SPLIT MAX_UNUSED_BYTES
+#include "implicit-spec.h"
+BENCH_SPEC_ADAPTERS(spec_first)
+
+#define SPEC_NAME spec_next
+#define SPEC_FIT HEAP_NEXTFIT
+#define SPEC_TAG block_size_t
+#define SPEC_ALIGN PAYLOAD_ALIGN
+#define SPEC_SPLIT MAX_UNUSED_BYTES
+#include "implicit-spec.h"
+BENCH_SPEC_ADAPTERS(spec_next)
+
+#define SPEC_NAME spec_best
+#define SPEC_FIT HEAP_BESTFIT
+#define SPEC_TAG block_size_t
+#define SPEC_ALIGN PAYLOAD_ALIGN
+#define SPEC_SPLIT MAX_UNUSED_BYTES
+#include "implicit-spec.h"
+BENCH_SPEC_ADAPTERS(spec_best)
+
+/*
+ * Size of the heap used by every benchmark run, and the number of live
+ * pointers a workload keeps at most.
+ */
+#define BENCH_HEAP_SIZE (1 << 24)
+#define BENCH_MAX_POINTERS 1000
+
+/*
+ * Number of heap operations per run, and the seed shared by all runs so
+ * that every configuration sees the same sequence of requests.
+ */
+#define BENCH_OPS 200000
+#define BENCH_SEED 0x2610ULL
+
+/*
+ * State of the random number generator of the workloads.
+ */
+static uint64_t rng_state;
+
+/*
+ * Current time in nanoseconds.
+ */
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Open a counter of data TLB read misses for this thread. Return -1 if
+ * the kernel or the CPU does not provide one, or perf events are not
+ * allowed.
+ */
+static int dtlb_counter_open()
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Result of one benchmark run.
+ */
+typedef struct bench_result {
+  uint64_t ops;            /* Operations performed. */
+  uint64_t elapsed_ns;     /* Wall clock time for all operations. */
+  unsigned long avg_free;  /* Average free block size at the end. */
+  int64_t dtlb_misses;     /* Data TLB read misses, or -1 if not measured. */
+} bench_result;
+
+/*
+ * Allocator under test: either the generic heap with a search algorithm
+ * and hardening options, or one of the specialized allocators.
+ */
+typedef struct bench_allocator {
+  const char *name;                    /* Name of the search algorithm. */
+  const char *config;                  /* Name of the configuration. */
+  search_alg_t search_alg;             /* Search algorithm of generic heaps. */
+  int hardening;                       /* Hardening options of generic heaps. */
+  int side_table;                      /* Search generic heaps via a side table. */
+  int huge;                            /* Back generic heaps with huge pages. */
+  int adaptive;                        /* Adaptive split policy for generic heaps. */
+  void *(*create)(intptr_t size);      /* Specialized allocator, or NULL. */
+  void (*destroy)(void *h);
+  void *(*malloc)(void *h, size_t size);
+  void (*free)(void *h, void *payload);
+  unsigned long (*avg_free)(void *h);
+} bench_allocator;
+
+/*
+ * Create the heap for a run, a heap or a heap of a specialized allocator.
+ */
+static void *bench_create(const bench_allocator *a)
+{
+  heap *h;
+  if (a->create != NULL)
+    return a->create(BENCH_HEAP_SIZE);
+  if (a->huge)
+    h = heap_create_huge(BENCH_HEAP_SIZE, a->search_alg);
+  else
+    h = heap_create(BENCH_HEAP_SIZE, a->search_alg);
+  if (h != NULL) {
+    heap_set_hardening(h, a->hardening);
+    if (a->side_table && heap_enable_side_table(h) < 0)
+      return NULL;
+    if (a->adaptive) {
+      heap_tuning tuning;
+      heap_get_tuning(h, &tuning);
+      tuning.adaptive = 1;
+      heap_set_tuning(h, &tuning);
+    }
+  }
+  return h;
+}
+
+/*
+ * Destroy the heap of a run.
+ */
+static void bench_destroy(const bench_allocator *a, void *h)
+{
+  if (a->create != NULL)
+    a->destroy(h);
+  else
+    heap_destroy(h);
+}
+
+/*
+ * Random malloc/free workload modelled on test_heap in implicit-test.c.
+ */
+static bench_result run_random(const bench_allocator *a)
+{
+  bench_result r = { 0, 0, 0, -1 };
+  void *h = bench_create(a);
+  char *pointers[BENCH_MAX_POINTERS];
+  int nb_pointers = 0;
+  int op, counter;
+
+  if (h == NULL)
+    return r;
+  rng_state = rng_init(BENCH_SEED);
+
+  counter = dtlb_counter_open();
+  if (counter >= 0)
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  uint64_t start = now_ns();
+  for (op = 0; op < BENCH_OPS; op++) {
+    if (nb_pointers == 0 || rng_next(&rng_state) % BENCH_MAX_POINTERS > nb_pointers) {
+      size_t size = rand_block_size(&rng_state);
+      char *p = a->create ? a->malloc(h, size) : heap_malloc(h, size);
+      if (p == NULL)
+	break;
+      pointers[nb_pointers++] = p;
+    }
+    else {
+      int index = rng_next(&rng_state) % nb_pointers;
+      if (a->create)
+	a->free(h, pointers[index]);
+      else
+	heap_free(h, pointers[index]);
+      pointers[index] = pointers[--nb_pointers];
+    }
+  }
+  r.elapsed_ns = now_ns() - start;
+  r.ops = op;
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter, &r.dtlb_misses, sizeof(r.dtlb_misses)) != sizeof(r.dtlb_misses))
+      r.dtlb_misses = -1;
+    close(counter);
+  }
+  r.avg_free = a->create ? a->avg_free(h) : heap_find_avg_free_block_size(h);
+  bench_destroy(a, h);
+  return r;
+}
+
+/*
+ * Size of the heap for the walk benchmark, the spacing of the holes made
+ * in it, and the number of timed searches.
+ */
+#define WALK_HEAP_SIZE (1 << 28)
+#define WALK_HOLE_EVERY 64
+#define WALK_REPS 10
+
+/*
+ * Time searches that walk a large, fragmented heap without finding a fit:
+ * first right after a free, which invalidates every walk hint, and then
+ * again with the hints recorded by the first search.
+ */
+static void run_walk()
+{
+  /* Filled with next fit, which appends in O(1), then searched with first fit */
+  heap *h = heap_create(WALK_HEAP_SIZE, HEAP_NEXTFIT);
+  void **holes = malloc(WALK_HEAP_SIZE / (16 * WALK_HOLE_EVERY) * sizeof(void *));
+  unsigned long blocks = 0, nb_holes = 0;
+  uint64_t linear_ns = 0, hinted_ns = 0, start;
+  void *p;
+  int i;
+
+  if (h == NULL || holes == NULL) {
+    printf("walk: cannot create a %d MiB heap\n", WALK_HEAP_SIZE >> 20);
+    return;
+  }
+  rng_state = rng_init(BENCH_SEED);
+  while ((p = heap_malloc(h, 8 + rng_next(&rng_state) % 56)) != NULL)
+    if (blocks++ % WALK_HOLE_EVERY == 0)
+      holes[nb_holes++] = p;
+  for (i = 0; i < nb_holes; i++)
+    heap_free(h, holes[i]);
+  h->search_alg = HEAP_FIRSTFIT;
+
+  for (i = 0; i < WALK_REPS; i++) {
+    heap_free(h, heap_malloc(h, 8));
+    start = now_ns();
+    heap_malloc(h, 4096);
+    linear_ns += now_ns() - start;
+    start = now_ns();
+    heap_malloc(h, 4096);
+    hinted_ns += now_ns() - start;
+  }
+  printf("Failed first fit search of a %d MiB heap, %lu blocks, %lu holes:\n",
+	 WALK_HEAP_SIZE >> 20, blocks, nb_holes);
+  printf("  every block: %8.2f ms (%.2f ns/block)\n", linear_ns / 1e6 / WALK_REPS,
+	 (double) linear_ns / WALK_REPS / blocks);
+  printf("  with hints:  %8.2f ms\n", hinted_ns / 1e6 / WALK_REPS);
+  heap_destroy(h);
+  free(holes);
+}
+
+/*
+ * Shape of the mixed lifetime workload: the number of short-lived blocks
+ * alive at once, and how often an allocation is long-lived instead.
+ */
+#define MIXED_SHORT_LIVE 256
+#define MIXED_LONG_EVERY 32
+
+/*
+ * Mixed lifetime workload: short-lived blocks are freed in allocation
+ * order after MIXED_SHORT_LIVE more, while long-lived ones are kept until
+ * the end. Run with and without lifetime hints, and report the average
+ * free block size.
+ */
+static void run_mixed(search_alg_t search_alg, const char *name, int hinted)
+{
+  heap *h = heap_create(BENCH_HEAP_SIZE, search_alg);
+  void *shorts[MIXED_SHORT_LIVE] = { NULL };
+  int op, failed = 0;
+  uint64_t start;
+
+  if (h == NULL) {
+    printf("mixed: cannot create a %d MiB heap\n", BENCH_HEAP_SIZE >> 20);
+    return;
+  }
+  rng_state = rng_init(BENCH_SEED);
+  start = now_ns();
+  for (op = 0; op < BENCH_OPS; op++) {
+    size_t size = rand_block_size(&rng_state);
+    if (rng_next(&rng_state) % MIXED_LONG_EVERY == 0) {
+      if (heap_malloc_hint(h, size, hinted ? HEAP_HINT_LONG : HEAP_HINT_NONE) == NULL)
+	failed++;
+    }
+    else {
+      int index = op % MIXED_SHORT_LIVE;
+      heap_free(h, shorts[index]);
+      shorts[index] = heap_malloc_hint(h, size, hinted ? HEAP_HINT_SHORT : HEAP_HINT_NONE);
+      if (shorts[index] == NULL)
+	failed++;
+    }
+  }
+  printf("%-10s %-10s %12.1f %12lu %12d\n", name, hinted ? "hinted" : "plain",
+	 (double) (now_ns() - start) / BENCH_OPS,
+	 (unsigned long) heap_find_avg_free_block_size(h), failed);
+  heap_destroy(h);
+}
+
+/*
+ * Order latencies for the percentiles of run_free_latency.
+ */
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Time every heap_free of the random workload on a first fit heap, with
+ * or without a side table and a background maintenance thread, and print
+ * percentiles.
+ */
+static void run_free_latency(int side_table, int maintained)
+{
+  heap *h = heap_create(BENCH_HEAP_SIZE, HEAP_FIRSTFIT);
+  heap_maintenance opts = { 1, 1 << 16 };
+  uint64_t *lat = malloc(BENCH_OPS * sizeof(uint64_t));
+  char *pointers[BENCH_MAX_POINTERS];
+  int nb_pointers = 0, nb_frees = 0, op;
+
+  if (h == NULL || lat == NULL || (side_table && heap_enable_side_table(h) < 0)
+      || (maintained && heap_start_maintenance(h, &opts) < 0)) {
+    printf("free latency: cannot set up the heap\n");
+    return;
+  }
+  rng_state = rng_init(BENCH_SEED);
+  for (op = 0; op < BENCH_OPS; op++) {
+    if (nb_pointers == 0 || rng_next(&rng_state) % BENCH_MAX_POINTERS > nb_pointers) {
+      char *p = heap_malloc(h, rand_block_size(&rng_state));
+      if (p == NULL)
+	break;
+      pointers[nb_pointers++] = p;
+    }
+    else {
+      int index = rng_next(&rng_state) % nb_pointers;
+      uint64_t start = now_ns();
+      heap_free(h, pointers[index]);
+      lat[nb_frees++] = now_ns() - start;
+      pointers[index] = pointers[--nb_pointers];
+    }
+  }
+  qsort(lat, nb_frees, sizeof(uint64_t), compare_u64);
+  if (nb_frees > 0)
+    printf("%-10s %-10s %10d %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+	   side_table ? "table" : "plain", maintained ? "background" : "inline", nb_frees, lat[nb_frees / 2],
+	   lat[nb_frees * 99 / 100], lat[nb_frees * 999 / 1000], lat[nb_frees - 1]);
+  heap_destroy(h);
+  free(lat);
+}
+
+/*
+ * Bytes of blocks allocated by the cold free benchmark, well over the size
+ * of a last level cache.
+ */
+#define COLD_BYTES (1 << 26)
+
+/*
+ * Time freeing blocks spread over COLD_BYTES in random order, so that
+ * every free touches cold memory, with heap_free or heap_free_sized.
+ */
+static void run_cold_free(int sized)
+{
+  /* Filled with next fit, which appends in O(1) */
+  heap *h = heap_create_on_node(2 * COLD_BYTES, HEAP_NEXTFIT, -1);
+  size_t max = COLD_BYTES / 16, n = 0, i;
+  void **blocks = malloc(max * sizeof(void *));
+  uint32_t *sizes = malloc(max * sizeof(uint32_t));
+  size_t bytes = 0;
+  uint64_t start, elapsed;
+
+  if (h == NULL || blocks == NULL || sizes == NULL) {
+    printf("cold free: cannot set up the heap\n");
+    return;
+  }
+  rng_state = rng_init(BENCH_SEED);
+  while (bytes < COLD_BYTES && n < max) {
+    sizes[n] = 16 + rng_next(&rng_state) % 240;
+    blocks[n] = heap_malloc(h, sizes[n]);
+    if (blocks[n] == NULL)
+      break;
+    bytes += sizes[n++];
+  }
+  for (i = n - 1; i > 0; i--) {
+    size_t j = rng_next(&rng_state) % (i + 1);
+    void *p = blocks[i];
+    uint32_t size = sizes[i];
+    blocks[i] = blocks[j];
+    sizes[i] = sizes[j];
+    blocks[j] = p;
+    sizes[j] = size;
+  }
+
+  start = now_ns();
+  if (sized)
+    for (i = 0; i < n; i++)
+      heap_free_sized(h, blocks[i], sizes[i]);
+  else
+    for (i = 0; i < n; i++)
+      heap_free(h, blocks[i]);
+  elapsed = now_ns() - start;
+  printf("%-16s %10zu %10.1f\n", sized ? "heap_free_sized" : "heap_free", n,
+	 (double) elapsed / n);
+  heap_destroy(h);
+  free(blocks);
+  free(sizes);
+}
+
+/*
+ * Blocks allocated by the startup benchmark, one in STARTUP_FREE_EVERY of
+ * them a temporary freed right after the next malloc, and the wilderness
+ * probe of its fast runs.
+ */
+#define STARTUP_BLOCKS 20000
+#define STARTUP_FREE_EVERY 8
+#define STARTUP_PROBE 16
+
+/*
+ * Time the mallocs of a startup phase, which allocates a lot and frees
+ * little, with and without a wilderness probe.
+ */
+static void run_startup(search_alg_t search_alg, const char *name, unsigned probe)
+{
+  heap *h = heap_create_on_node(BENCH_HEAP_SIZE, search_alg, -1);
+  heap_tuning tuning;
+  void *temp = NULL;
+  uint64_t start, elapsed;
+  int i, failed = 0;
+
+  if (h == NULL) {
+    printf("startup: cannot create a %d MiB heap\n", BENCH_HEAP_SIZE >> 20);
+    return;
+  }
+  heap_get_tuning(h, &tuning);
+  tuning.wilderness_probe = probe;
+  heap_set_tuning(h, &tuning);
+  rng_state = rng_init(BENCH_SEED);
+
+  start = now_ns();
+  for (i = 0; i < STARTUP_BLOCKS; i++) {
+    void *p = heap_malloc(h, 16 + rng_next(&rng_state) % 240);
+    if (p == NULL)
+      failed++;
+    if (temp != NULL) {
+      heap_free(h, temp);
+      temp = NULL;
+    }
+    if (i % STARTUP_FREE_EVERY == 0)
+      temp = p;
+  }
+  elapsed = now_ns() - start;
+  printf("%-10s %-10u %12.1f %12d\n", name, probe, (double) elapsed / STARTUP_BLOCKS,
+	 failed);
+  heap_destroy(h);
+}
+
+/*
+ * Print one row of the results table.
+ */
+static void print_result(const bench_allocator *a, bench_result r)
+{
+  double secs = r.elapsed_ns / 1e9;
+  char misses[24] = "n/a";
+  if (r.dtlb_misses >= 0)
+    snprintf(misses, sizeof(misses), "%" PRId64, r.dtlb_misses);
+  printf("%-10s %-10s %10" PRIu64 " %12.0f %12.1f %12lu %14s\n", a->name, a->config,
+	 r.ops, secs > 0 ? r.ops / secs : 0, r.ops ? (double) r.elapsed_ns / r.ops : 0,
+	 r.avg_free, misses);
+}
+
+/*
+ * Every configuration that is benchmarked.
+ */
+static const bench_allocator allocators[] = {
+  { "first", "plain", HEAP_FIRSTFIT, 0, 0, 0, 0, NULL },
+  { "first", "hardened", HEAP_FIRSTFIT, HEAP_HARDEN_ALL, 0, 0, 0, NULL },
+  { "first", "table", HEAP_FIRSTFIT, 0, 1, 0, 0, NULL },
+  { "first", "huge", HEAP_FIRSTFIT, 0, 0, 1, 0, NULL },
+  { "first", "adaptive", HEAP_FIRSTFIT, 0, 0, 0, 1, NULL },
+  { "first", "spec", HEAP_FIRSTFIT, 0, 0, 0, 0, BENCH_SPEC(spec_first) },
+  { "next", "plain", HEAP_NEXTFIT, 0, 0, 0, 0, NULL },
+  { "next", "hardened", HEAP_NEXTFIT, HEAP_HARDEN_ALL, 0, 0, 0, NULL },
+  { "next", "table", HEAP_NEXTFIT, 0, 1, 0, 0, NULL },
+  { "next", "huge", HEAP_NEXTFIT, 0, 0, 1, 0, NULL },
+  { "next", "adaptive", HEAP_NEXTFIT, 0, 0, 0, 1, NULL },
+  { "next", "spec", HEAP_NEXTFIT, 0, 0, 0, 0, BENCH_SPEC(spec_next) },
+  { "segnext", "plain", HEAP_SEGNEXTFIT, 0, 0, 0, 0, NULL },
+  { "segnext", "hardened", HEAP_SEGNEXTFIT, HEAP_HARDEN_ALL, 0, 0, 0, NULL },
+  { "segnext", "table", HEAP_SEGNEXTFIT, 0, 1, 0, 0, NULL },
+  { "segnext", "huge", HEAP_SEGNEXTFIT, 0, 0, 1, 0, NULL },
+  { "segnext", "adaptive", HEAP_SEGNEXTFIT, 0, 0, 0, 1, NULL },
+  { "best", "plain", HEAP_BESTFIT, 0, 0, 0, 0, NULL },
+  { "best", "hardened", HEAP_BESTFIT, HEAP_HARDEN_ALL, 0, 0, 0, NULL },
+  { "best", "table", HEAP_BESTFIT, 0, 1, 0, 0, NULL },
+  { "best", "huge", HEAP_BESTFIT, 0, 0, 1, 0, NULL },
+  { "best", "adaptive", HEAP_BESTFIT, 0, 0, 0, 1, NULL },
+  { "best", "spec", HEAP_BESTFIT, 0, 0, 0, 0, BENCH_SPEC(spec_best) },
+};
+
+/*
+ * Run every configuration on the same seeded workload.
+ */
+int main(int argc, char *argv[])
+{
+  static const char *page_kinds[] = { "none", "hugetlbfs", "transparent" };
+  size_t i;
+  heap *h = heap_create_huge(4096, HEAP_FIRSTFIT);
+
+  printf("Huge pages: %s\n", h ? page_kinds[heap_page_kind(h)] : "none");
+  if (h != NULL)
+    heap_destroy(h);
+  printf("%-10s %-10s %10s %12s %12s %12s %14s\n", "alg", "config", "ops",
+	 "ops/s", "ns/op", "avg free", "dTLB misses");
+  for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+    print_result(&allocators[i], run_random(&allocators[i]));
+  printf("\nMixed short and long-lived blocks:\n");
+  printf("%-10s %-10s %12s %12s %12s\n", "alg", "config", "ns/op", "avg free", "failed");
+  for (i = 0; i < 2; i++) {
+    run_mixed(HEAP_FIRSTFIT, "first", i);
+    run_mixed(HEAP_NEXTFIT, "next", i);
+    run_mixed(HEAP_SEGNEXTFIT, "segnext", i);
+    run_mixed(HEAP_BESTFIT, "best", i);
+  }
+  printf("\nFirst fit heap_free latency (ns):\n");
+  printf("%-10s %-10s %10s %10s %10s %10s %10s\n", "config", "free", "frees", "p50",
+	 "p99", "p99.9", "max");
+  for (i = 0; i < 4; i++)
+    run_free_latency(i / 2, i % 2);
+  printf("\nStartup phase mallocs:\n");
+  printf("%-10s %-10s %12s %12s\n", "alg", "probe", "ns/malloc", "failed");
+  for (i = 0; i < 2; i++) {
+    run_startup(HEAP_FIRSTFIT, "first", i * STARTUP_PROBE);
+    run_startup(HEAP_NEXTFIT, "next", i * STARTUP_PROBE);
+    run_startup(HEAP_SEGNEXTFIT, "segnext", i * STARTUP_PROBE);
+    run_startup(HEAP_BESTFIT, "best", i * STARTUP_PROBE);
+  }
+  printf("\nFrees of cold blocks in random order:\n");
+  printf("%-16s %10s %10s\n", "free", "frees", "ns/free");
+  run_cold_free(0);
+  run_cold_free(1);
+  printf("\n");
+  run_walk();
+  return 0;
+}
@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "implicit.h"
+#include "bench-util.h"
+
+/*
+ * Head-to-head comparison of the heap, with every search algorithm,
+ * against the system allocator. Each workload replays the same seeded
+ * sequence of requests through every allocator. Every run happens in a
+ * fresh child process, so that memory use is measured from a clean
+ * slate: once untimed, for throughput, RSS and fragmentation, and once
+ * timing every operation, for latency percentiles. The system rows use
+ * whatever allocator serves malloc, so another one, such as jemalloc, is
+ * compared by preloading it. The exit status is non-zero if any run
+ * failed, so the comparison can gate changes.
+ */
+
+/*
+ * Size of the heap of each run, and default number of operations and
+ * seed of each workload.
+ */
+#define COMPARE_HEAP_SIZE ((intptr_t) 1 << 28)
+#define COMPARE_OPS 200000
+#define COMPARE_SEED 0x2610ULL
+
+/*
+ * Live blocks of the random workload at most, live blocks and block size
+ * of the fixed-size churn, slots of the producer/consumer queue, and
+ * number and largest size of the growing buffers.
+ */
+#define RANDOM_MAX_POINTERS 1000
+#define CHURN_BLOCKS 4096
+#define CHURN_SIZE 64
+#define QUEUE_SLOTS 1024
+#define GROW_BUFFERS 64
+#define GROW_MAX (64 * 1024)
+
+/*
+ * Stride at which new payloads are touched, so that they count as
+ * resident the way they would in a program that fills them.
+ */
+#define TOUCH_STRIDE 4096
+
+/*
+ * Options, set from the command line.
+ */
+static uint64_t seed = COMPARE_SEED;
+static int nb_ops = COMPARE_OPS;
+
+/*
+ * State of the random number generator of the workloads.
+ */
+static uint64_t rng_state;
+
+/*
+ * Current time in nanoseconds.
+ */
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Allocator under test: a heap with one of the search algorithms, or the
+ * system allocator.
+ */
+typedef struct compare_allocator {
+  const char *name;
+  search_alg_t search_alg;
+  int system;
+} compare_allocator;
+
+static const compare_allocator allocators[] = {
+  { "first", HEAP_FIRSTFIT, 0 },
+  { "next", HEAP_NEXTFIT, 0 },
+  { "best", HEAP_BESTFIT, 0 },
+  { "segnext", HEAP_SEGNEXTFIT, 0 },
+  { "system", HEAP_FIRSTFIT, 1 },
+};
+
+/*
+ * Heap of the current run, or NULL when the system allocator is tested.
+ */
+static heap *the_heap;
+
+/*
+ * State of one thread of a run.
+ */
+typedef struct compare_thread {
+  uint64_t *lat;        /* Latency of each operation, or NULL when untimed. */
+  size_t nb_lat;        /* Latencies recorded. */
+  uint64_t ops;         /* Operations performed. */
+  int64_t live;         /* Bytes requested by the live blocks it allocated, */
+  int64_t peak_live;    /* and their peak. */
+  int failed;           /* Requests that could not be served. */
+} compare_thread;
+
+/*
+ * Write to every page of a new payload.
+ */
+static void touch(char *p, size_t from, size_t to)
+{
+  for (; from < to; from += TOUCH_STRIDE)
+    p[from] = 1;
+  if (to > 0)
+    p[to - 1] = 1;
+}
+
+/*
+ * Start timing an operation, and record its latency.
+ */
+static inline uint64_t op_start(compare_thread *t)
+{
+  return t->lat ? now_ns() : 0;
+}
+
+static inline void op_end(compare_thread *t, uint64_t start, int64_t live_delta)
+{
+  if (t->lat)
+    t->lat[t->nb_lat++] = now_ns() - start;
+  t->ops++;
+  t->live += live_delta;
+  if (t->live > t->peak_live)
+    t->peak_live = t->live;
+}
+
+/*
+ * Allocation operations, timed when the thread records latencies.
+ */
+static void *do_malloc(compare_thread *t, size_t size)
+{
+  uint64_t start = op_start(t);
+  void *p = the_heap ? heap_malloc(the_heap, size) : malloc(size);
+  op_end(t, start, p ? (int64_t) size : 0);
+  if (p == NULL)
+    t->failed++;
+  else
+    touch(p, 0, size);
+  return p;
+}
+
+static void do_free(compare_thread *t, void *p, size_t size)
+{
+  uint64_t start = op_start(t);
+  if (the_heap)
+    heap_free(the_heap, p);
+  else
+    free(p);
+  op_end(t, start, -(int64_t) size);
+}
+
+static void *do_realloc(compare_thread *t, void *p, size_t old_size, size_t size)
+{
+  uint64_t start = op_start(t);
+  void *q = the_heap ? heap_realloc(the_heap, p, size) : realloc(p, size);
+  op_end(t, start, q ? (int64_t) (size - old_size) : 0);
+  if (q == NULL)
+    t->failed++;
+  else
+    touch(q, old_size, size);
+  return q;
+}
+
+/*
+ * Free a block allocated by another thread. Heaps queue it for the owner
+ * with heap_free_remote.
+ */
+static void do_remote_free(compare_thread *t, void *p, size_t size)
+{
+  uint64_t start = op_start(t);
+  if (the_heap)
+    heap_free_remote(the_heap, p);
+  else
+    free(p);
+  op_end(t, start, -(int64_t) size);
+}
+
+/*
+ * Random mallocs and frees of get_rand_block_size blocks, as in
+ * implicit-bench.
+ */
+static void run_random(compare_thread *t)
+{
+  void *pointers[RANDOM_MAX_POINTERS];
+  size_t sizes[RANDOM_MAX_POINTERS];
+  int nb_pointers = 0, op;
+
+  for (op = 0; op < nb_ops; op++) {
+    if (nb_pointers == 0
+	|| rng_next(&rng_state) % RANDOM_MAX_POINTERS > (uint64_t) nb_pointers) {
+      sizes[nb_pointers] = rand_block_size(&rng_state);
+      pointers[nb_pointers] = do_malloc(t, sizes[nb_pointers]);
+      if (pointers[nb_pointers] != NULL)
+	nb_pointers++;
+    }
+    else {
+      int index = rng_next(&rng_state) % nb_pointers;
+      do_free(t, pointers[index], sizes[index]);
+      nb_pointers--;
+      pointers[index] = pointers[nb_pointers];
+      sizes[index] = sizes[nb_pointers];
+    }
+  }
+  while (nb_pointers > 0) {
+    nb_pointers--;
+    do_free(t, pointers[nb_pointers], sizes[nb_pointers]);
+  }
+}
+
+/*
+ * A fixed population of same-sized blocks, one of which is replaced by
+ * every pair of operations.
+ */
+static void run_churn(compare_thread *t)
+{
+  static void *blocks[CHURN_BLOCKS];
+  int i, op;
+
+  for (i = 0; i < CHURN_BLOCKS; i++)
+    blocks[i] = do_malloc(t, CHURN_SIZE);
+  for (op = 0; op < nb_ops; op += 2) {
+    i = rng_next(&rng_state) % CHURN_BLOCKS;
+    if (blocks[i] != NULL)
+      do_free(t, blocks[i], CHURN_SIZE);
+    blocks[i] = do_malloc(t, CHURN_SIZE);
+  }
+  for (i = 0; i < CHURN_BLOCKS; i++)
+    if (blocks[i] != NULL)
+      do_free(t, blocks[i], CHURN_SIZE);
+}
+
+/*
+ * Single producer, single consumer queue of blocks.
+ */
+typedef struct compare_queue {
+  void *blocks[QUEUE_SLOTS];
+  size_t sizes[QUEUE_SLOTS];
+  size_t head;             /* Blocks pushed, written by the producer. */
+  size_t tail;             /* Blocks popped, written by the consumer. */
+  int done;                /* Set once the producer pushed its last block. */
+  compare_thread consumer;
+} compare_queue;
+
+/*
+ * Free the blocks of the queue as they arrive.
+ */
+static void *consume(void *arg)
+{
+  compare_queue *q = arg;
+  size_t tail = 0, head;
+
+  for (;;) {
+    head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (__atomic_load_n(&q->done, __ATOMIC_ACQUIRE)
+	  && __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail)
+	return NULL;
+      sched_yield();
+      continue;
+    }
+    for (; tail < head; tail++)
+      do_remote_free(&q->consumer, q->blocks[tail % QUEUE_SLOTS],
+		     q->sizes[tail % QUEUE_SLOTS]);
+    __atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * The calling thread allocates blocks and hands them to a consumer
+ * thread, which frees them. The bytes in the queue are tracked by the
+ * producer, which subtracts the sizes of the blocks popped since it last
+ * looked at the tail.
+ */
+static void run_prodcons(compare_thread *t)
+{
+  static compare_queue q;
+  pthread_t consumer;
+  size_t head, seen = 0, tail;
+  int op;
+
+  q.consumer = (compare_thread) { t->lat ? t->lat + nb_ops : NULL, 0, 0, 0, 0, 0 };
+  if (pthread_create(&consumer, NULL, consume, &q) != 0) {
+    t->failed++;
+    return;
+  }
+  for (op = 0, head = 0; op < nb_ops / 2; op++) {
+    size_t size = rand_block_size(&rng_state);
+    while (head - (tail = __atomic_load_n(&q.tail, __ATOMIC_ACQUIRE)) == QUEUE_SLOTS)
+      sched_yield();
+    for (; seen < tail; seen++)
+      t->live -= q.sizes[seen % QUEUE_SLOTS];
+    void *p = do_malloc(t, size);
+    if (p == NULL)
+      continue;
+    q.blocks[head % QUEUE_SLOTS] = p;
+    q.sizes[head % QUEUE_SLOTS] = size;
+    __atomic_store_n(&q.head, ++head, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&q.done, 1, __ATOMIC_RELEASE);
+  pthread_join(consumer, NULL);
+  if (the_heap)
+    heap_drain_remote_frees(the_heap);
+  t->ops += q.consumer.ops;
+  if (t->lat) {
+    memmove(t->lat + t->nb_lat, q.consumer.lat, q.consumer.nb_lat * sizeof(uint64_t));
+    t->nb_lat += q.consumer.nb_lat;
+  }
+}
+
+/*
+ * Buffers that grow by half again at each realloc, as strings and vectors
+ * do while they are built, and are freed and started over once they reach
+ * GROW_MAX bytes.
+ */
+static void run_growing(compare_thread *t)
+{
+  void *buffers[GROW_BUFFERS] = { NULL };
+  size_t sizes[GROW_BUFFERS] = { 0 };
+  int i, op;
+
+  for (op = 0; op < nb_ops; op++) {
+    i = rng_next(&rng_state) % GROW_BUFFERS;
+    if (buffers[i] == NULL) {
+      sizes[i] = 16 + rng_next(&rng_state) % 48;
+      buffers[i] = do_malloc(t, sizes[i]);
+    }
+    else if (sizes[i] >= GROW_MAX) {
+      do_free(t, buffers[i], sizes[i]);
+      buffers[i] = NULL;
+    }
+    else {
+      size_t size = sizes[i] + sizes[i] / 2 + rng_next(&rng_state) % 64;
+      void *p = do_realloc(t, buffers[i], sizes[i], size);
+      if (p != NULL) {
+	buffers[i] = p;
+	sizes[i] = size;
+      }
+    }
+  }
+  for (i = 0; i < GROW_BUFFERS; i++)
+    if (buffers[i] != NULL)
+      do_free(t, buffers[i], sizes[i]);
+}
+
+/*
+ * Every workload.
+ */
+typedef struct compare_workload {
+  const char *name;
+  void (*run)(compare_thread *t);
+} compare_workload;
+
+static const compare_workload workloads[] = {
+  { "random", run_random },
+  { "churn", run_churn },
+  { "prodcons", run_prodcons },
+  { "growing", run_growing },
+};
+
+/*
+ * Result of one run, sent by the child process to the parent.
+ */
+typedef struct compare_result {
+  uint64_t ops;            /* Operations performed. */
+  uint64_t elapsed_ns;     /* Wall clock time of the untimed pass. */
+  uint64_t p50, p99, p999; /* Latency percentiles of the timed pass, in ns. */
+  int64_t rss;             /* Peak growth of the resident set, in bytes. */
+  int64_t peak_live;       /* Peak bytes requested by live blocks. */
+  int failed;              /* Requests that could not be served. */
+} compare_result;
+
+/*
+ * Read a field of /proc/self/status, in bytes, or return -1.
+ */
+static int64_t read_status(const char *field)
+{
+  FILE *f = fopen("/proc/self/status", "r");
+  char line[256];
+  long long kb = -1;
+  size_t len = strlen(field);
+
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL)
+    if (strncmp(line, field, len) == 0 && sscanf(line + len, "%lld", &kb) == 1)
+      break;
+  fclose(f);
+  return kb < 0 ? -1 : kb * 1024;
+}
+
+/*
+ * Reset the peak resident set size of the process to its current size.
+ */
+static void reset_peak_rss()
+{
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd >= 0) {
+    if (write(fd, "5", 1) != 1) {}
+    close(fd);
+  }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Run a workload on an allocator in the calling process, timing each
+ * operation if timed is set.
+ */
+static compare_result run_one(const compare_workload *w, const compare_allocator *a,
+			      int timed)
+{
+  compare_result r = { 0, 0, 0, 0, 0, -1, 0, 0 };
+  compare_thread t = { NULL, 0, 0, 0, 0, 0 };
+  size_t lat_len = 2 * (size_t) nb_ops + 2 * CHURN_BLOCKS + GROW_BUFFERS;
+  int64_t base, peak;
+  uint64_t start;
+
+  /* Latencies are kept out of the allocator under test, and resident
+     before the baseline is taken */
+  if (timed) {
+    t.lat = mmap(NULL, lat_len * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (t.lat == MAP_FAILED) {
+      r.failed = 1;
+      return r;
+    }
+    memset(t.lat, 0, lat_len * sizeof(uint64_t));
+  }
+  if (!a->system) {
+    the_heap = heap_create_on_node(COMPARE_HEAP_SIZE, a->search_alg, -1);
+    if (the_heap == NULL) {
+      r.failed = 1;
+      return r;
+    }
+  }
+  rng_state = rng_init(seed);
+  reset_peak_rss();
+  base = read_status("VmRSS:");
+
+  start = now_ns();
+  w->run(&t);
+  r.elapsed_ns = now_ns() - start;
+
+  peak = read_status("VmHWM:");
+  r.ops = t.ops;
+  r.failed = t.failed;
+  r.peak_live = t.peak_live;
+  if (base >= 0 && peak >= base)
+    r.rss = peak - base;
+  if (timed && t.nb_lat > 0) {
+    qsort(t.lat, t.nb_lat, sizeof(uint64_t), compare_u64);
+    r.p50 = t.lat[t.nb_lat / 2];
+    r.p99 = t.lat[t.nb_lat * 99 / 100];
+    r.p999 = t.lat[t.nb_lat * 999 / 1000];
+  }
+  return r;
+}
+
+/*
+ * Run a workload on an allocator in a child process. Return 0 on
+ * success, -1 if the child did not report a result.
+ */
+static int run_child(const compare_workload *w, const compare_allocator *a, int timed,
+		     compare_result *r)
+{
+  int fds[2], status;
+  pid_t pid;
+  ssize_t n;
+
+  fflush(stdout);
+  if (pipe(fds) < 0)
+    return -1;
+  pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    compare_result res = run_one(w, a, timed);
+    close(fds[0]);
+    if (write(fds[1], &res, sizeof(res)) != sizeof(res)) {}
+    _exit(0);
+  }
+  close(fds[1]);
+  n = read(fds[0], r, sizeof(*r));
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+  return n == sizeof(*r) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/*
+ * Print how to invoke the tool.
+ */
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-o ops] [-s seed]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t w, a;
+  int opt, failed = 0;
+
+  while ((opt = getopt(argc, argv, "o:s:h")) != -1) {
+    switch (opt) {
+    case 'o': nb_ops = atoi(optarg); break;
+    case 's': seed = strtoull(optarg, NULL, 0); break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (nb_ops <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  printf("%-10s %-8s %12s %8s %8s %8s %10s %8s %8s\n", "workload", "alloc", "ops/s",
+	 "p50 ns", "p99 ns", "p99.9 ns", "RSS KiB", "frag %", "failed");
+  for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    for (a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+      compare_result plain, timed;
+      if (run_child(&workloads[w], &allocators[a], 0, &plain) < 0
+	  || run_child(&workloads[w], &allocators[a], 1, &timed) < 0) {
+	printf("%-10s %-8s crashed\n", workloads[w].name, allocators[a].name);
+	failed = 1;
+	continue;
+      }
+      /* Fragmentation: resident memory not holding requested bytes */
+      double frag = plain.rss > plain.peak_live
+	? 100.0 * (plain.rss - plain.peak_live) / plain.rss : 0;
+      printf("%-10s %-8s %12.0f %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %10" PRId64
+	     " %8.1f %8d\n", workloads[w].name, allocators[a].name,
+	     plain.elapsed_ns ? plain.ops * 1e9 / plain.elapsed_ns : 0,
+	     timed.p50, timed.p99, timed.p999, plain.rss / 1024, frag, plain.failed);
+      if (plain.failed || plain.rss < 0)
+	failed = 1;
+    }
+  }
+  return failed;
+}
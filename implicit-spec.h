@@ -0,0 +1,247 @@
+/*
+ * Template for heap allocators specialized at compile time. Each inclusion
+ * generates a complete allocator for one combination of search policy,
+ * tag width, payload alignment and split threshold, with the search loop
+ * and all header arithmetic specialized for it. Define the parameters and
+ * include this file:
+ *
+ *   #define SPEC_NAME small_first      // prefix of the generated functions
+ *   #define SPEC_FIT HEAP_FIRSTFIT     // HEAP_FIRSTFIT, HEAP_NEXTFIT or HEAP_BESTFIT
+ *   #define SPEC_TAG uint32_t          // type of headers and footers
+ *   #define SPEC_ALIGN 8               // payload alignment, a power of two
+ *   #define SPEC_SPLIT 128             // split when this many bytes would be unused
+ *   #include "implicit-spec.h"
+ *
+ * This generates the heap type small_first_heap and the C functions
+ *
+ *   small_first_heap *small_first_create(intptr_t size);
+ *   void small_first_destroy(small_first_heap *h);
+ *   void *small_first_malloc(small_first_heap *h, size_t size);
+ *   void small_first_free(small_first_heap *h, void *payload);
+ *   unsigned long small_first_avg_free_block_size(small_first_heap *h);
+ *
+ * The parameters are undefined at the end of the file, so it can be
+ * included again for another combination. Each specialization has its own
+ * heap type, so the compiler rejects passing its heaps to the generic
+ * heap_* functions or to another specialization.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "implicit.h"
+
+#if !defined(SPEC_NAME) || !defined(SPEC_FIT) || !defined(SPEC_TAG) \
+  || !defined(SPEC_ALIGN) || !defined(SPEC_SPLIT)
+#error "SPEC_NAME, SPEC_FIT, SPEC_TAG, SPEC_ALIGN and SPEC_SPLIT must be defined"
+#endif
+
+#ifndef SPEC_CONCAT
+#define SPEC_CONCAT_(a, b) a##_##b
+#define SPEC_CONCAT(a, b) SPEC_CONCAT_(a, b)
+#endif
+#define SPEC_FN(fn) SPEC_CONCAT(SPEC_NAME, fn)
+#define SPEC_HEAP SPEC_FN(heap)
+
+_Static_assert((SPEC_ALIGN & (SPEC_ALIGN - 1)) == 0 && SPEC_ALIGN >= sizeof(SPEC_TAG),
+	       "SPEC_ALIGN must be a power of two no smaller than SPEC_TAG");
+
+/*
+ * Heap of this specialization. Only its functions may touch the fields.
+ */
+typedef struct SPEC_HEAP {
+  void *start;                      /* First block. */
+  SPEC_TAG size;                    /* Size of the block area in bytes. */
+  void *next;                       /* Where the next fit search resumes. */
+  size_t len;                       /* Length of the mapping holding the heap. */
+} SPEC_HEAP;
+
+/*
+ * Block header arithmetic for this specialization.
+ */
+static inline int SPEC_FN(in_use)(void *block_start)
+{
+  return 1 & *((SPEC_TAG *) block_start);
+}
+
+static inline SPEC_TAG SPEC_FN(block_size)(void *block_start)
+{
+  return -(SPEC_TAG) SPEC_ALIGN & *((SPEC_TAG *) block_start);
+}
+
+static inline void SPEC_FN(set_header)(void *block_start, SPEC_TAG size, int in_use)
+{
+  *((SPEC_TAG *) block_start) = size | in_use;
+  *((SPEC_TAG *) (block_start + size - sizeof(SPEC_TAG))) = size | in_use;
+}
+
+/*
+ * Size of the block needed for a request, or 0 if it cannot be served.
+ */
+static inline SPEC_TAG SPEC_FN(size_to_allocate)(size_t user_size)
+{
+  if (user_size == 0
+      || user_size > (SPEC_TAG) -SPEC_ALIGN - 2 * sizeof(SPEC_TAG) - SPEC_ALIGN)
+    return 0;
+  return (user_size + 2 * sizeof(SPEC_TAG) + SPEC_ALIGN - 1) & -(SPEC_TAG) SPEC_ALIGN;
+}
+
+/*
+ * Mark a free block as used, splitting off the unused part when it is
+ * more than the request or at least SPEC_SPLIT bytes.
+ */
+static inline void *SPEC_FN(prepare)(void *block_start, SPEC_TAG real_size)
+{
+  SPEC_TAG unused = SPEC_FN(block_size)(block_start) - real_size;
+  if ((unused > real_size || unused >= SPEC_SPLIT) && unused >= 2 * sizeof(SPEC_TAG)) {
+    SPEC_FN(set_header)(block_start, real_size, 1);
+    SPEC_FN(set_header)(block_start + real_size, unused, 0);
+  }
+  else {
+    SPEC_FN(set_header)(block_start, real_size + unused, 1);
+  }
+  return block_start + sizeof(SPEC_TAG);
+}
+
+/*
+ * Create a heap that is "size" bytes large, including its header, in
+ * memory of its own.
+ */
+static SPEC_HEAP *SPEC_FN(create)(intptr_t size)
+{
+  if (size < (intptr_t) (sizeof(SPEC_HEAP) + 2 * SPEC_ALIGN + 2 * sizeof(SPEC_TAG))
+      || (uintmax_t) size > (SPEC_TAG) -SPEC_ALIGN)
+    return NULL;
+
+  void *heap_start = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (heap_start == MAP_FAILED)
+    return NULL;
+
+  SPEC_HEAP *h = heap_start;
+  void *end = heap_start + size;
+  h->len = size;
+  heap_start += sizeof(SPEC_HEAP);
+
+  /* The payload, one tag after the block start, must be aligned */
+  uintptr_t payload = ((uintptr_t) heap_start + sizeof(SPEC_TAG) + SPEC_ALIGN - 1)
+    & -(uintptr_t) SPEC_ALIGN;
+  heap_start = (void *) (payload - sizeof(SPEC_TAG));
+  size = (end - heap_start) & -(intptr_t) SPEC_ALIGN;
+
+  h->size = size;
+  h->start = heap_start;
+  h->next = heap_start;
+  SPEC_FN(set_header)(heap_start, size, 0);
+  return h;
+}
+
+/*
+ * Return the memory of a heap to the system.
+ */
+static void SPEC_FN(destroy)(SPEC_HEAP *h)
+{
+  if (h != NULL)
+    munmap(h, h->len);
+}
+
+/*
+ * Malloc a block using the search policy of this specialization.
+ */
+static void *SPEC_FN(malloc)(SPEC_HEAP *h, size_t size)
+{
+  SPEC_TAG real_size = SPEC_FN(size_to_allocate)(size);
+  void *end = h->start + h->size;
+  void *blk;
+
+  if (real_size == 0)
+    return NULL;
+
+  /* SPEC_FIT is a constant, so only one of these loops is compiled in */
+  if (SPEC_FIT == HEAP_BESTFIT) {
+    void *best_blk = NULL;
+    SPEC_TAG best_size = 0;
+    for (blk = h->start; blk < end; blk += SPEC_FN(block_size)(blk)) {
+      SPEC_TAG blk_size = SPEC_FN(block_size)(blk);
+      if (!SPEC_FN(in_use)(blk) && blk_size >= real_size
+	  && (best_blk == NULL || blk_size <= best_size)) {
+	best_blk = blk;
+	best_size = blk_size;
+      }
+    }
+    return best_blk ? SPEC_FN(prepare)(best_blk, real_size) : NULL;
+  }
+
+  if (SPEC_FIT == HEAP_NEXTFIT) {
+    for (blk = h->next; blk < end; blk += SPEC_FN(block_size)(blk)) {
+      if (!SPEC_FN(in_use)(blk) && SPEC_FN(block_size)(blk) >= real_size) {
+	h->next = blk;
+	return SPEC_FN(prepare)(blk, real_size);
+      }
+    }
+    end = h->next;
+  }
+
+  for (blk = h->start; blk < end; blk += SPEC_FN(block_size)(blk)) {
+    if (!SPEC_FN(in_use)(blk) && SPEC_FN(block_size)(blk) >= real_size) {
+      h->next = blk;
+      return SPEC_FN(prepare)(blk, real_size);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Free a block, coalescing it with free neighbours.
+ */
+static void SPEC_FN(free)(SPEC_HEAP *h, void *payload)
+{
+  if (payload == NULL)
+    return;
+
+  void *blk = payload - sizeof(SPEC_TAG);
+  SPEC_TAG size = SPEC_FN(block_size)(blk);
+  void *next = blk + size;
+
+  if (next < h->start + h->size && !SPEC_FN(in_use)(next)) {
+    size += SPEC_FN(block_size)(next);
+    if (h->next == next)
+      h->next = blk;
+  }
+  if (blk != h->start) {
+    SPEC_TAG prev_tag = *((SPEC_TAG *) (blk - sizeof(SPEC_TAG)));
+    if (!(prev_tag & 1)) {
+      void *prev = blk - (prev_tag & -(SPEC_TAG) SPEC_ALIGN);
+      if (h->next == blk)
+	h->next = prev;
+      size += blk - prev;
+      blk = prev;
+    }
+  }
+  SPEC_FN(set_header)(blk, size, 0);
+}
+
+/*
+ * Average size of the free blocks of a heap, or 0 if it has none.
+ */
+static unsigned long SPEC_FN(avg_free_block_size)(SPEC_HEAP *h)
+{
+  unsigned long sum = 0, count = 0;
+  void *blk;
+  for (blk = h->start; blk < h->start + h->size; blk += SPEC_FN(block_size)(blk)) {
+    if (!SPEC_FN(in_use)(blk)) {
+      sum += SPEC_FN(block_size)(blk);
+      count++;
+    }
+  }
+  return count ? sum / count : 0;
+}
+
+#undef SPEC_HEAP
+#undef SPEC_FN
+#undef SPEC_NAME
+#undef SPEC_FIT
+#undef SPEC_TAG
+#undef SPEC_ALIGN
+#undef SPEC_SPLIT
@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "implicit.h"
+#include "bench-util.h"
+
+/*
+ * Randomized stress test of the heap. Each seed generates a sequence of
+ * mallocs, aligned mallocs, reallocs and frees. The private phase runs
+ * every seed on its own heap, with seeds spread over parallel threads.
+ * The shared phase then runs one seed per thread on a single thread-safe
+ * heap. The heap is checked, and the contents of every live block
+ * verified, every few operations. A failing seed is shrunk to a short
+ * sequence of operations that still fails, and printed.
+ */
+
+/*
+ * Size of the heap of each private run, number of blocks a run keeps
+ * live at most, and bound on the runs spent shrinking a failure.
+ */
+#define STRESS_HEAP_SIZE (1 << 20)
+#define STRESS_SLOTS 64
+#define STRESS_SHRINK_RUNS 2000
+
+/*
+ * Kinds of operations in a sequence.
+ */
+typedef enum { OP_MALLOC, OP_CALLOC, OP_ALIGNED, OP_REALLOC, OP_FREE, OP_TRIM } stress_op_kind;
+
+static const char *op_names[] = { "malloc", "calloc", "malloc_aligned", "realloc", "free", "trim" };
+
+/*
+ * One operation. Blocks are picked by index among the live blocks, so a
+ * sequence stays meaningful when operations are removed from it.
+ */
+typedef struct stress_op {
+  stress_op_kind kind;
+  uint32_t size;      /* Request size of malloc, calloc, malloc_aligned and realloc. */
+  uint32_t pick;      /* Live block operated on, modulo the live count. */
+  int overflow;       /* Write a byte past the new block (fault injection). */
+} stress_op;
+
+/*
+ * A live block and the byte its payload is filled with.
+ */
+typedef struct stress_slot {
+  unsigned char *p;
+  uint32_t size;
+  unsigned char fill;
+} stress_slot;
+
+/*
+ * Where and how a run failed.
+ */
+typedef struct stress_failure {
+  int op;             /* Index of the last operation performed. */
+  const char *what;   /* What went wrong. */
+  heap_error_t err;   /* Error reported by the heap, if any. */
+} stress_failure;
+
+/*
+ * Options, set from the command line.
+ */
+static int nb_threads = 4;
+static uint64_t first_seed = 1;
+static int nb_seeds = 64;
+static int nb_ops = 20000;
+static int check_every = 100;
+static int overflow_every = 0;
+static search_alg_t search_alg = HEAP_FIRSTFIT;
+static int wilderness_probe = 0;
+
+/*
+ * Seeds handed to the private phase threads, and the first seed that
+ * failed there, or 0.
+ */
+static uint64_t next_seed;
+static uint64_t failed_seed;
+
+/*
+ * Name of a heap error.
+ */
+static const char *error_name(heap_error_t err)
+{
+  static const char *names[] = {
+    "ok", "size", "total", "footer", "adjacent free", "next", "align",
+    "range", "double free", "canary", "table", "lock", "hint", "free size"
+  };
+  /* One name per heap_error_t; HEAP_ERR_FREE_SIZE is the last error. */
+  _Static_assert(sizeof(names) / sizeof(names[0]) == HEAP_ERR_FREE_SIZE + 1,
+                 "error_name does not cover every heap_error_t");
+  if ((unsigned) err >= sizeof(names) / sizeof(names[0]))
+    return "unknown";
+  return names[err];
+}
+
+/*
+ * Generate the sequence of n operations of a seed.
+ */
+static void generate_ops(uint64_t seed, stress_op *ops, int n)
+{
+  uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+  int i;
+  for (i = 0; i < n; i++) {
+    uint64_t r = rng_next(&state);
+    int kind = r % 20;
+    ops[i].kind = kind < 7 ? OP_MALLOC : kind < 8 ? OP_CALLOC : kind < 10 ? OP_ALIGNED
+      : kind < 14 ? OP_REALLOC : kind < 19 ? OP_FREE : OP_TRIM;
+    ops[i].size = 1 + (r >> 8) % (8u << ((r >> 24) % 9));
+    ops[i].pick = r >> 32;
+    ops[i].overflow = overflow_every > 0 && ops[i].kind == OP_MALLOC
+      && (r >> 40) % overflow_every == 0;
+  }
+}
+
+/*
+ * Return 1 if the first n bytes of a block still hold its fill byte.
+ */
+static int block_intact(unsigned char *p, uint32_t n, unsigned char fill)
+{
+  uint32_t i;
+  for (i = 0; i < n; i++)
+    if (p[i] != fill)
+      return 0;
+  return 1;
+}
+
+/*
+ * Check the heap and the contents of every live block.
+ */
+static int check_run(heap *h, stress_slot *slots, int live, stress_failure *f)
+{
+  int i;
+  f->err = heap_check(h, HEAP_CHECK_DEEP);
+  if (f->err != HEAP_OK) {
+    f->what = "heap_check";
+    return -1;
+  }
+  for (i = 0; i < live; i++) {
+    if (!block_intact(slots[i].p, slots[i].size, slots[i].fill)) {
+      f->what = "block contents changed";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Perform ops[0..n) on h, checking every "every" operations and at the
+ * end. Return 0, or -1 with the failure described in f. Blocks still live
+ * at the end are freed unless the run failed.
+ */
+static int run_ops(heap *h, const stress_op *ops, int n, int every, stress_failure *f)
+{
+  stress_slot slots[STRESS_SLOTS];
+  int live = 0, i;
+
+  f->err = HEAP_OK;
+  for (i = 0; i < n; i++) {
+    const stress_op *op = &ops[i];
+    unsigned char fill = (i & 0xff) | 1;
+    int k = live ? op->pick % live : 0;
+    unsigned char *p;
+    f->op = i;
+
+    if (op->kind == OP_TRIM) {
+      heap_trim(h, 4096);
+    }
+    else if (op->kind != OP_REALLOC && op->kind != OP_FREE && live < STRESS_SLOTS) {
+      size_t alignment = 16 << (op->pick % 4);
+      p = op->kind == OP_MALLOC ? heap_malloc(h, op->size)
+	: op->kind == OP_CALLOC ? heap_calloc(h, 1, op->size)
+	: heap_malloc_aligned(h, alignment, op->size);
+      if (p == NULL)
+	continue;
+      if (op->kind == OP_ALIGNED && (uintptr_t) p % alignment != 0) {
+	f->what = "misaligned block";
+	return -1;
+      }
+      if (op->kind == OP_CALLOC && !block_intact(p, op->size, 0)) {
+	f->what = "calloc block not zeroed";
+	return -1;
+      }
+      memset(p, fill, op->size);
+      if (op->overflow)
+	p[heap_usable_size(h, p)] ^= 0xff;
+      slots[live++] = (stress_slot) { p, op->size, fill };
+    }
+    else if (op->kind == OP_REALLOC && live > 0) {
+      stress_slot *s = &slots[k];
+      uint32_t kept = s->size < op->size ? s->size : op->size;
+      p = heap_realloc(h, s->p, op->size);
+      if (p == NULL)
+	continue;
+      if (!block_intact(p, kept, s->fill)) {
+	f->what = "realloc lost contents";
+	return -1;
+      }
+      memset(p, fill, op->size);
+      *s = (stress_slot) { p, op->size, fill };
+    }
+    else if (live > 0) {
+      if (!block_intact(slots[k].p, slots[k].size, slots[k].fill)) {
+	f->what = "block contents changed";
+	return -1;
+      }
+      f->err = op->size % 2 ? heap_free_sized(h, slots[k].p, slots[k].size)
+	: heap_free(h, slots[k].p);
+      if (f->err != HEAP_OK) {
+	f->what = "heap_free";
+	return -1;
+      }
+      slots[k] = slots[--live];
+    }
+
+    if ((i + 1) % every == 0 && check_run(h, slots, live, f) < 0)
+      return -1;
+  }
+  if (check_run(h, slots, live, f) < 0)
+    return -1;
+  while (live > 0)
+    heap_free(h, slots[--live].p);
+  return 0;
+}
+
+/*
+ * Create a mapped heap of the given size with the selected options.
+ */
+static heap *create_heap(intptr_t size)
+{
+  heap *h = heap_create_on_node(size, search_alg, -1);
+  heap_tuning tuning;
+  if (h != NULL && wilderness_probe > 0) {
+    heap_get_tuning(h, &tuning);
+    tuning.wilderness_probe = wilderness_probe;
+    heap_set_tuning(h, &tuning);
+  }
+  return h;
+}
+
+/*
+ * Run a sequence on a fresh private heap. Mapped heaps are used because,
+ * unlike sbrk heaps, they can be created from any thread.
+ */
+static int run_private(const stress_op *ops, int n, int every, stress_failure *f)
+{
+  heap *h = create_heap(STRESS_HEAP_SIZE);
+  int ret;
+  if (h == NULL) {
+    perror("heap_create_on_node");
+    exit(2);
+  }
+  ret = run_ops(h, ops, n, every, f);
+  heap_destroy(h);
+  return ret;
+}
+
+/*
+ * Shrink a failing sequence, checking after every operation: cut it after
+ * the operation that fails, then drop chunks of operations, halving the
+ * chunk size, for as long as what remains still fails. Return the length
+ * of the shrunk sequence, which replaces the start of ops.
+ */
+static int shrink_ops(stress_op *ops, int n, stress_failure *f)
+{
+  stress_op *candidate = malloc(n * sizeof(stress_op));
+  stress_failure cf;
+  int runs = 0, chunk, start;
+
+  if (candidate == NULL || run_private(ops, n, 1, f) == 0) {
+    free(candidate);
+    return -1;
+  }
+  n = f->op + 1;
+  for (chunk = n / 2; chunk >= 1; chunk /= 2) {
+    for (start = 0; start < n && runs < STRESS_SHRINK_RUNS; runs++) {
+      int len = chunk < n - start ? chunk : n - start;
+      memcpy(candidate, ops, start * sizeof(stress_op));
+      memcpy(candidate + start, ops + start + len, (n - start - len) * sizeof(stress_op));
+      if (n - len > 0 && run_private(candidate, n - len, 1, &cf) < 0) {
+	n = cf.op + 1;
+	memcpy(ops, candidate, n * sizeof(stress_op));
+	*f = cf;
+      }
+      else {
+	start += len;
+      }
+    }
+  }
+  free(candidate);
+  return n;
+}
+
+/*
+ * Print a failure, and the shrunk sequence that reproduces it on a
+ * private heap if there is one.
+ */
+static void report(uint64_t seed, const char *phase, stress_failure *f)
+{
+  stress_op *ops = malloc(nb_ops * sizeof(stress_op));
+  int n, i;
+
+  printf("seed %" PRIu64 " failed in the %s phase after operation %d: %s",
+	 seed, phase, f->op, f->what);
+  if (f->err != HEAP_OK)
+    printf(" (%s)", error_name(f->err));
+  printf("\n");
+  if (ops == NULL)
+    return;
+
+  generate_ops(seed, ops, nb_ops);
+  n = shrink_ops(ops, nb_ops, f);
+  if (n < 0) {
+    printf("  does not fail on a private heap; it needs concurrent threads\n");
+  }
+  else {
+    printf("  shrunk to %d operations, failing at the last with: %s", n, f->what);
+    if (f->err != HEAP_OK)
+      printf(" (%s)", error_name(f->err));
+    printf("\n");
+    for (i = 0; i < n; i++)
+      printf("  %4d %-14s size %5" PRIu32 " pick %10" PRIu32 "%s\n", i,
+	     op_names[ops[i].kind], ops[i].size, ops[i].pick,
+	     ops[i].overflow ? " overflow" : "");
+  }
+  free(ops);
+}
+
+/*
+ * Private phase thread: run seeds on private heaps until none are left or
+ * one fails.
+ */
+static void *private_worker(void *arg)
+{
+  stress_op *ops = malloc(nb_ops * sizeof(stress_op));
+  stress_failure f;
+  uint64_t seed;
+
+  if (ops == NULL)
+    return NULL;
+  while (__atomic_load_n(&failed_seed, __ATOMIC_RELAXED) == 0
+	 && (seed = __atomic_fetch_add(&next_seed, 1, __ATOMIC_RELAXED))
+	    < first_seed + nb_seeds) {
+    generate_ops(seed, ops, nb_ops);
+    if (run_private(ops, nb_ops, check_every, &f) < 0) {
+      uint64_t none = 0;
+      __atomic_compare_exchange_n(&failed_seed, &none, seed, 0,
+				  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+  }
+  free(ops);
+  return NULL;
+}
+
+/*
+ * Shared phase thread: run the seed of the thread on the shared heap.
+ */
+typedef struct shared_run {
+  pthread_t thread;
+  heap *h;
+  uint64_t seed;
+  int failed;
+  stress_failure f;
+} shared_run;
+
+static void *shared_worker(void *arg)
+{
+  shared_run *run = arg;
+  stress_op *ops = malloc(nb_ops * sizeof(stress_op));
+  if (ops == NULL)
+    return NULL;
+  generate_ops(run->seed, ops, nb_ops);
+  run->failed = run_ops(run->h, ops, nb_ops, check_every, &run->f) < 0;
+  free(ops);
+  return NULL;
+}
+
+/*
+ * Run the private phase. Return 0 if every seed passed.
+ */
+static int private_phase()
+{
+  pthread_t *threads = calloc(nb_threads, sizeof(pthread_t));
+  stress_failure f;
+  int i;
+
+  next_seed = first_seed;
+  for (i = 0; i < nb_threads; i++)
+    pthread_create(&threads[i], NULL, private_worker, NULL);
+  for (i = 0; i < nb_threads; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  if (failed_seed == 0) {
+    printf("private: %d seeds of %d operations on %d threads passed\n",
+	   nb_seeds, nb_ops, nb_threads);
+    return 0;
+  }
+
+  stress_op *ops = malloc(nb_ops * sizeof(stress_op));
+  generate_ops(failed_seed, ops, nb_ops);
+  run_private(ops, nb_ops, check_every, &f);
+  free(ops);
+  report(failed_seed, "private", &f);
+  return 1;
+}
+
+/*
+ * Run the shared phase. Return 0 if every thread passed.
+ */
+static int shared_phase()
+{
+  heap *h = create_heap((intptr_t) STRESS_HEAP_SIZE * nb_threads);
+  shared_run *runs = calloc(nb_threads, sizeof(shared_run));
+  int i, failed = 0;
+
+  if (h == NULL || runs == NULL || heap_set_thread_safe(h) < 0) {
+    perror("shared heap");
+    return 2;
+  }
+  for (i = 0; i < nb_threads; i++) {
+    runs[i].h = h;
+    runs[i].seed = first_seed + i;
+    pthread_create(&runs[i].thread, NULL, shared_worker, &runs[i]);
+  }
+  for (i = 0; i < nb_threads; i++)
+    pthread_join(runs[i].thread, NULL);
+  for (i = 0; i < nb_threads; i++) {
+    if (runs[i].failed) {
+      report(runs[i].seed, "shared", &runs[i].f);
+      failed = 1;
+    }
+  }
+  if (!failed)
+    printf("shared: %d threads of %d operations on one heap passed\n", nb_threads, nb_ops);
+  heap_destroy(h);
+  free(runs);
+  return failed;
+}
+
+/*
+ * Print how to invoke the tool.
+ */
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-t threads] [-s first-seed] [-n seeds] [-o ops]\n"
+	  "       [-c check-every] [-a first|next|best|segnext] [-w wilderness-probe]\n"
+	  "       [-x overflow-every]\n", prog);
+  fprintf(stderr, "-x injects a write past one new block in that many mallocs,\n"
+	  "to test the harness itself.\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, failed;
+  while ((opt = getopt(argc, argv, "t:s:n:o:c:a:w:x:h")) != -1) {
+    switch (opt) {
+    case 't': nb_threads = atoi(optarg); break;
+    case 's': first_seed = strtoull(optarg, NULL, 0); break;
+    case 'n': nb_seeds = atoi(optarg); break;
+    case 'o': nb_ops = atoi(optarg); break;
+    case 'c': check_every = atoi(optarg); break;
+    case 'x': overflow_every = atoi(optarg); break;
+    case 'w': wilderness_probe = atoi(optarg); break;
+    case 'a':
+      if (strcmp(optarg, "first") == 0)
+	search_alg = HEAP_FIRSTFIT;
+      else if (strcmp(optarg, "next") == 0)
+	search_alg = HEAP_NEXTFIT;
+      else if (strcmp(optarg, "best") == 0)
+	search_alg = HEAP_BESTFIT;
+      else if (strcmp(optarg, "segnext") == 0)
+	search_alg = HEAP_SEGNEXTFIT;
+      else {
+	usage(argv[0]);
+	return 2;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (nb_threads <= 0 || first_seed == 0 || nb_seeds <= 0 || nb_ops <= 0
+      || check_every <= 0 || overflow_every < 0 || wilderness_probe < 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  failed = private_phase();
+  if (!failed)
+    failed = shared_phase();
+  return failed;
+}
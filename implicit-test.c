@@ -76,10 +76,13 @@ unsigned long test_heap(search_alg_t search_alg, int op_count)
     }
 #if DEBUG
     heap_print(h);
+    if (heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+      printf("Heap check failed with %d operations left.\n", op_count);
 #endif
   }
   
   fragmentation = heap_find_avg_free_block_size(h);
+  heap_destroy(h);
   return fragmentation;
 }
 
@@ -100,4 +103,5 @@ int main(int argc, char *argv[])
   printf("First fit average block size: %lu\n", test_heap(HEAP_FIRSTFIT, 50000));
   printf("Next fit average block size: %lu\n", test_heap(HEAP_NEXTFIT, 50000));
   printf("Best fit average block size: %lu\n", test_heap(HEAP_BESTFIT, 50000));
+  printf("Segregated next fit average block size: %lu\n", test_heap(HEAP_SEGNEXTFIT, 50000));
 }
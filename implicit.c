@@ -1,10 +1,143 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#if HEAP_TAG_BITS == 32 && defined(__x86_64__)
+#include <immintrin.h>
+#define SIDE_TABLE_SIMD 1
+#endif
 
 #include "implicit.h"
 
+/*
+ * Number of freed blocks held back by the hardened quarantine.
+ */
+#define QUARANTINE_SLOTS 16
+
+/*
+ * Size classes with their own roving pointer in HEAP_SEGNEXTFIT heaps.
+ * Class 0 holds blocks of up to 2^ROVER_MIN_SHIFT bytes, each following
+ * class doubles the limit, and the last class holds every larger block.
+ */
+#define ROVER_CLASSES 8
+#define ROVER_MIN_SHIFT 5
+
+/*
+ * Bounds of the split threshold chosen by the adaptive split policy, and
+ * the internal waste it accepts by default.
+ */
+#define SPLIT_THRESHOLD_MIN (2 * PAYLOAD_ALIGN)
+#define SPLIT_THRESHOLD_MAX 4096
+#define SPLIT_WASTE_PERCENT 10
+
+/*
+ * Blocks a search walks by default before it takes the request from the
+ * wilderness block at the end of the heap. Off by default, since it gives
+ * up the address order placement of the search algorithms.
+ */
+#define WILDERNESS_PROBE 0
+
+/*
+ * Spare header bit, next to the in-use bit, set on blocks whose payload is
+ * known to be zero past its first sizeof(walk_hint) bytes: memory fresh
+ * from the system, or just trimmed, that nothing has written to since.
+ * set_block_header clears it, so any block that is rewritten loses it.
+ */
+#define BLOCK_ZERO 2
+
+/*
+ * Guard word written after the payload of blocks in hardened heaps. It is
+ * mixed with the block offset so it cannot be forged by copying a block,
+ * and stays valid when a persistent heap is mapped at another address.
+ */
+#define CANARY_VALUE ((payload_align_t) 0x5a17c0de5a17c0deULL)
+#define CANARY_SIZE (sizeof(payload_align_t))
+
+/*
+ * Distance in bytes ahead of the current block that block walks prefetch.
+ * Blocks are contiguous, so memory is walked forward; 0 disables it.
+ */
+#ifndef HEAP_WALK_PREFETCH
+#define HEAP_WALK_PREFETCH 256
+#endif
+
+/*
+ * Shortest run of allocated blocks worth a walk hint. Shorter runs are
+ * faster to stream through than to jump over.
+ */
+#ifndef HEAP_WALK_HINT_MIN
+#define HEAP_WALK_HINT_MIN 1024
+#endif
+
+/*
+ * Hint kept at the start of the payload of free blocks, letting searches
+ * for free blocks jump over the allocated blocks that follow: skip is the
+ * number of bytes between the end of the block and the next free block
+ * (or the end of the heap). It is only valid while gen matches the
+ * hint_gen of the heap, which changes whenever a block is freed. Free
+ * headers are written with a zero hint, which is never valid.
+ */
+typedef struct walk_hint {
+  block_size_t skip;
+  uint32_t gen;
+} walk_hint;
+
+/*
+ * Per-heap control state that does not fit in struct heap. It sits right
+ * below the struct heap in memory, so that the layout of the block area
+ * for a given heap_create size is unchanged.
+ */
+typedef struct heap_ext {
+  int flags;                        /* HEAP_HARDEN_* options. */
+  int quarantine_head;              /* Index of the oldest quarantined block. */
+  int quarantine_len;               /* Number of quarantined blocks. */
+  uint32_t hint_gen;                /* Generation of valid walk hints. */
+  void *quarantine[QUARANTINE_SLOTS];
+  void *rovers[ROVER_CLASSES];      /* Next block to try per size class. */
+  heap_tuning tuning;               /* Split policy. */
+  heap_split_stats split_stats;     /* Split policy counters, */
+  heap_split_stats split_window;    /* and their values at the last review. */
+  block_size_t split_threshold_max; /* Largest split threshold blocks were handed out under. */
+  block_size_t *table_tags;         /* Side table: header of each block, */
+  block_size_t *table_offsets;      /* and its offset from h->start. */
+  size_t table_len;                 /* Number of blocks in the side table. */
+  size_t table_cap;                 /* Capacity of the side table. */
+  void *region;                     /* Mapping of a persistent heap, or NULL. */
+  size_t region_len;                /* Length of that mapping, or of the sbrk region. */
+  int fd;                           /* File of a persistent or shared heap. */
+  int pages;                        /* HEAP_PAGES_* backing of the heap. */
+  struct heap_shared_header *shared; /* Shared state of a shared heap, or NULL. */
+  void *remote_frees;               /* Payloads freed by other threads. */
+  pthread_mutex_t *lock;            /* Lock taken by every operation, or NULL. */
+  pthread_mutex_t local_lock;       /* The lock of thread-safe private heaps. */
+  struct heap_profile *profile;     /* Sampling profiler, or NULL. */
+  struct heap_worker *worker;       /* Maintenance thread, or NULL. */
+  int in_pass;                      /* Set while a maintenance pass has the lock dropped. */
+} heap_ext;
+
+_Static_assert(sizeof(heap_ext) % _Alignof(heap) == 0,
+	       "heap_ext must preserve the alignment of struct heap");
+
+/*
+ * Return the control state of the heap.
+ */
+static inline heap_ext *get_ext(heap *h)
+{
+  return ((heap_ext *) h) - 1;
+}
+
 /*
  * Determine whether or not a block is in use.
  */
@@ -55,8 +188,27 @@ static inline void set_block_header(void *block_start, block_size_t block_size,
   *((block_size_t *) block_start) = header_value;
   *((block_size_t *) (get_payload(block_start) +
 		      get_payload_size(block_start))) = header_value;
+  if (!in_use && block_size >= 2 * HEADER_SIZE + sizeof(walk_hint))
+    *((walk_hint *) get_payload(block_start)) = (walk_hint) { 0, 0 };
+}
+
+/*
+ * Determine whether the payload of a block is known to be zero past its
+ * first sizeof(walk_hint) bytes.
+ */
+static inline int block_is_zero(void *block_start)
+{
+  return (BLOCK_ZERO & *((block_size_t *) block_start)) != 0;
 }
 
+/*
+ * Mark a block as known to be zero, in its header and footer.
+ */
+static inline void mark_block_zero(void *block_start)
+{
+  *((block_size_t *) block_start) |= BLOCK_ZERO;
+  *((block_size_t *) (get_payload(block_start) + get_payload_size(block_start))) |= BLOCK_ZERO;
+}
 
 /*
  * Find the start of the next block.
@@ -106,6 +258,165 @@ static inline int is_within_heap_range(heap *h, void *addr)
   return addr >= h->start && addr < h->start + h->size;
 }
 
+/*
+ * Return the walk hint of a free block if it is valid, or NULL.
+ */
+static inline walk_hint *get_hint(heap *h, void *block_start)
+{
+  walk_hint *hint = get_payload(block_start);
+  if (get_block_size(block_start) < 2 * HEADER_SIZE + sizeof(walk_hint)
+      || hint->gen != get_ext(h)->hint_gen)
+    return NULL;
+  return hint;
+}
+
+/*
+ * Invalidate every walk hint of the heap. Must be called whenever a block
+ * is freed or a block boundary disappears.
+ */
+static inline void invalidate_hints(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  if (++ext->hint_gen == 0)
+    ext->hint_gen = 1;
+}
+
+/*
+ * Iterator over the blocks of [start, end) of a heap, shared by all the
+ * loops that search or visit blocks. It prefetches ahead of the current
+ * block. When only free blocks are wanted, it jumps over allocated blocks
+ * using the walk hints of free blocks, and records new hints as it goes.
+ * Hints are not used for persistent and shared heaps, where other users
+ * of the heap do not share hint_gen, nor on hardened heaps, where a write
+ * to a freed block must not be able to misdirect the allocator.
+ *
+ *   block_walk w;
+ *   for (blk = walk_start(&w, h, h->start, end, 1); blk; blk = walk_next(&w)) ...
+ */
+typedef struct block_walk {
+  heap *h;
+  void *blk;                        /* Current block, NULL at the end. */
+  void *end;                        /* End of the walk. */
+  int free_only;                    /* Visit free blocks only. */
+  int hints;                        /* Use and record walk hints. */
+  void *last_free;                  /* Free block to record a hint in, or NULL. */
+} block_walk;
+
+/*
+ * Make the first block at or after blk that the walk visits current.
+ */
+static inline void *walk_from(block_walk *w, void *blk)
+{
+  if (w->free_only) {
+    while (blk < w->end && block_is_in_use(blk)) {
+      blk = get_next_block(blk);
+      __builtin_prefetch(blk + HEAP_WALK_PREFETCH);
+    }
+    if (w->last_free != NULL
+	&& blk - get_next_block(w->last_free) >= HEAP_WALK_HINT_MIN
+	&& (blk < w->end || w->end == w->h->start + w->h->size)) {
+      walk_hint *hint = get_payload(w->last_free);
+      hint->skip = blk - get_next_block(w->last_free);
+      hint->gen = get_ext(w->h)->hint_gen;
+    }
+    w->last_free = NULL;
+  }
+  w->blk = blk < w->end ? blk : NULL;
+  return w->blk;
+}
+
+/*
+ * Start a walk of the blocks of [start, end), visiting only free blocks
+ * if free_only is set. Return the first block visited, or NULL.
+ */
+static inline void *walk_start(block_walk *w, heap *h, void *start, void *end,
+			       int free_only)
+{
+  w->h = h;
+  w->end = end;
+  w->free_only = free_only;
+  w->hints = free_only && get_ext(h)->fd < 0
+    && !(get_ext(h)->flags & HEAP_HARDEN_FREE);
+  w->last_free = NULL;
+  return walk_from(w, start);
+}
+
+/*
+ * Advance a walk. Return the next block visited, or NULL.
+ */
+static inline void *walk_next(block_walk *w)
+{
+  void *next = get_next_block(w->blk);
+  if (w->hints) {
+    walk_hint *hint = get_hint(w->h, w->blk);
+    if (hint != NULL)
+      next += hint->skip;
+    else if (get_block_size(w->blk) >= 2 * HEADER_SIZE + sizeof(walk_hint))
+      w->last_free = w->blk;
+  }
+  __builtin_prefetch(next + HEAP_WALK_PREFETCH);
+  return walk_from(w, next);
+}
+
+/*
+ * Point the rover of every size class at h->next.
+ */
+static inline void reset_rovers(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  int i;
+  for (i = 0; i < ROVER_CLASSES; i++)
+    ext->rovers[i] = h->next;
+}
+
+/*
+ * Move the roving pointers at block "from" to block "to", when "from" is
+ * about to stop being a block boundary.
+ */
+static inline void move_rovers(heap *h, void *from, void *to)
+{
+  heap_ext *ext = get_ext(h);
+  int i;
+  if (h->next == from)
+    h->next = to;
+  for (i = 0; i < ROVER_CLASSES; i++)
+    if (ext->rovers[i] == from)
+      ext->rovers[i] = to;
+}
+
+/*
+ * Return the roving pointer a next fit search for a block of real_size
+ * bytes starts from: h->next, or the rover of its size class.
+ */
+static inline void **get_rover(heap *h, block_size_t real_size)
+{
+  int class;
+  if (h->search_alg != HEAP_SEGNEXTFIT)
+    return &h->next;
+  class = real_size <= (1 << ROVER_MIN_SHIFT) ? 0
+    : 8 * sizeof(long long) - __builtin_clzll(real_size - 1) - ROVER_MIN_SHIFT;
+  if (class >= ROVER_CLASSES)
+    class = ROVER_CLASSES - 1;
+  return &get_ext(h)->rovers[class];
+}
+
+/*
+ * Move the rovers of HEAP_SEGNEXTFIT heaps back to a block just freed, for
+ * every size class it can serve. Freed space is then reused before the
+ * rovers split the large free blocks ahead of them.
+ */
+static inline void pull_rovers(heap *h, void *blk)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t size = get_block_size(blk);
+  int i;
+  if (h->search_alg != HEAP_SEGNEXTFIT)
+    return;
+  for (i = 0; i < ROVER_CLASSES; i++)
+    if (blk < ext->rovers[i] && size >= (block_size_t) 1 << (i + ROVER_MIN_SHIFT - 1))
+      ext->rovers[i] = blk;
+}
+
 /*
  * Coalesce a block with its consecutive block, only if both blocks are free.
  * Return a pointer to the beginning of the coalesced block.
@@ -121,10 +432,10 @@ static inline void *coalesce(heap *h, void *first_block_start)
     // Check if next block exits and is free. If both are true, change header of first and footer
     // of second to total size.
     if(is_within_heap_range(h, next) && !block_is_in_use(next)){
-      int total_size = get_block_size(first_block_start)+ get_block_size(next);
+      block_size_t total_size = get_block_size(first_block_start)+ get_block_size(next);
       set_block_header(first_block_start, total_size, 0);
-      if(next == h->next)
-        h->next = first_block_start; // if h->next is being coalesced, then set h->next to the combined block
+      get_ext(h)->split_stats.coalesces++;
+      move_rovers(h, next, first_block_start); // if a rover is being coalesced, then set it to the combined block
       return first_block_start;
     }
   }
@@ -134,57 +445,150 @@ static inline void *coalesce(heap *h, void *first_block_start)
 /*
  * Determine the size of the block we need to allocate given the size
  * the user requested. Don't forget we need space for the header  and
- * footer, and that the user size may not be aligned.
+ * footer, and that the user size may not be aligned. A user size of 0
+ * gives a block with no payload (2 * HEADER_SIZE bytes), and a user size
+ * too large to be represented in a header gives 0.
  */
-// FIXME: not sure how to handle when user_size = 0
 static inline block_size_t get_size_to_allocate(block_size_t user_size)
 {
-  /* TO BE COMPLETED BY THE STUDENT. */
-  if(user_size % PAYLOAD_ALIGN == 0){
-    return user_size + 2*HEADER_SIZE;
-  }
-  else{
-    return (user_size / PAYLOAD_ALIGN + 2)*PAYLOAD_ALIGN;
-  }  
+  if (user_size > MAX_USER_SIZE)
+    return 0;
+  return (user_size + 2 * HEADER_SIZE + PAYLOAD_ALIGN - 1) & -PAYLOAD_ALIGN;
 }
 
 /*
  * Turn a free block into one the user can utilize. Split the block if
- * it's more than twice as large or MAX_UNUSED_BYTES bytes larger than
+ * it's more than twice as large or split_threshold bytes larger than
  * needed.
  */
-static inline void *prepare_block_for_use(void *block_start, block_size_t real_size)
+static inline void *prepare_block_for_use(void *block_start, block_size_t real_size,
+					  block_size_t split_threshold)
 {
   /* TO BE COMPLETED BY THE STUDENT. */
   block_size_t blk_size = get_block_size(block_start);
+  int zero = block_is_zero(block_start);
   if(blk_size < real_size){
     return NULL;
   }
-  else if(blk_size > 2*real_size || blk_size >= real_size + MAX_UNUSED_BYTES){
+  else if(blk_size - real_size > real_size || blk_size - real_size >= split_threshold){
     set_block_header(block_start, real_size, 1);
     set_block_header(block_start+real_size, (blk_size - real_size), 0);
+    if(zero){ // both parts lie past the walk hint of the block
+      mark_block_zero(block_start);
+      mark_block_zero(block_start+real_size);
+    }
     return block_start;
   }
   else{
     set_block_header(block_start, blk_size, 1);
+    if(zero)
+      mark_block_zero(block_start);
     return block_start;
   }
 }
 
 /*
- * Create a heap that is "size" bytes large, including its header.
+ * Review the split threshold of an adaptive heap from the counters of the
+ * allocations since the last review. Too much internal waste halves it;
+ * little waste while most allocations split and coalesce doubles it.
  */
-heap *heap_create(intptr_t size, search_alg_t search_alg)
+static void adapt_split_threshold(heap *h)
 {
-  /* Allocate space in the process' actual heap */
-  void *heap_start = sbrk(size);
-  if (heap_start == (void *) -1) return NULL;
-  
-  /* Use the first part of the allocated space for the heap header */
-  heap *h = heap_start;
-  heap_start += sizeof(heap);
-  size -= sizeof(heap);
-  
+  heap_ext *ext = get_ext(h);
+  heap_split_stats *now = &ext->split_stats, *then = &ext->split_window;
+  uint64_t allocs = now->allocs - then->allocs;
+  uint64_t bytes = now->bytes - then->bytes;
+  uint64_t waste = now->waste - then->waste;
+  uint64_t churn = now->splits - then->splits + now->coalesces - then->coalesces;
+  block_size_t threshold = ext->tuning.split_threshold;
+
+  if (waste * 100 > bytes * ext->tuning.waste_percent) {
+    if (threshold / 2 >= SPLIT_THRESHOLD_MIN)
+      ext->tuning.split_threshold = threshold / 2;
+  }
+  else if (waste * 200 < bytes * ext->tuning.waste_percent && churn * 2 >= allocs) {
+    if (threshold < SPLIT_THRESHOLD_MAX)
+      ext->tuning.split_threshold = threshold * 2;
+    if (ext->split_threshold_max < ext->tuning.split_threshold)
+      ext->split_threshold_max = ext->tuning.split_threshold;
+  }
+  *then = *now;
+}
+
+/*
+ * Hand out a free block for a request of real_size bytes under the split
+ * policy of the heap, and count it.
+ */
+static inline void *claim_block(heap *h, void *blk, block_size_t real_size)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t size = get_block_size(blk);
+
+  blk = prepare_block_for_use(blk, real_size, ext->tuning.split_threshold);
+  ext->split_stats.allocs++;
+  ext->split_stats.bytes += real_size;
+  if (get_block_size(blk) != size)
+    ext->split_stats.splits++;
+  else
+    ext->split_stats.waste += size - real_size;
+  if (ext->tuning.adaptive
+      && ext->split_stats.allocs - ext->split_window.allocs >= HEAP_SPLIT_ADAPT_INTERVAL)
+    adapt_split_threshold(h);
+  return blk;
+}
+
+/*
+ * Set up the control state of a new heap.
+ */
+static void init_ext(heap_ext *ext)
+{
+  ext->quarantine_head = 0;
+  ext->quarantine_len = 0;
+  ext->hint_gen = 1;
+  ext->table_tags = NULL;
+  ext->table_offsets = NULL;
+  ext->table_len = 0;
+  ext->table_cap = 0;
+  ext->region = NULL;
+  ext->region_len = 0;
+  ext->fd = -1;
+  ext->pages = HEAP_PAGES_NORMAL;
+  ext->shared = NULL;
+  ext->remote_frees = NULL;
+  ext->lock = NULL;
+  ext->profile = NULL;
+  ext->worker = NULL;
+  ext->in_pass = 0;
+  ext->tuning = (heap_tuning) { MAX_UNUSED_BYTES, 0, SPLIT_WASTE_PERCENT, WILDERNESS_PROBE };
+  ext->split_threshold_max = MAX_UNUSED_BYTES;
+  memset(&ext->split_stats, 0, sizeof(ext->split_stats));
+  ext->split_window = ext->split_stats;
+#ifdef HEAP_HARDENED
+  ext->flags = HEAP_HARDEN_ALL;
+#else
+  ext->flags = 0;
+#endif
+}
+
+/*
+ * Determine whether a heap of "size" bytes can hold its header and at
+ * least one block, with the block area fitting in a single block header.
+ */
+static int heap_size_is_valid(intptr_t size)
+{
+  return size >= (intptr_t) (sizeof(heap) + 2 * PAYLOAD_ALIGN)
+    && size - sizeof(heap) <= MAX_BLOCK_SIZE;
+}
+
+/*
+ * Lay out a heap whose control state and header are at ext, and whose
+ * blocks fill the "size" bytes at heap_start.
+ */
+static heap *layout_heap(heap_ext *ext, void *heap_start, intptr_t size,
+			 search_alg_t search_alg, int zero)
+{
+  heap *h = (heap *) (ext + 1);
+
   /* Ensures the heap_start points to an address that has space for
      the header, while allowing the payload to be aligned to PAYLOAD_ALIGN */
   int delta = PAYLOAD_ALIGN - HEADER_SIZE -
@@ -198,177 +602,2903 @@ heap *heap_create(intptr_t size, search_alg_t search_alg)
   /* Ensures the size points to as many bytes as necessary so that
      only full-sized blocks fit into the heap.
    */
-  size -= (size - 2 * HEADER_SIZE) % PAYLOAD_ALIGN;
+  size -= size % PAYLOAD_ALIGN;
   
   h->size = size;
   h->start = heap_start;
   h->search_alg = search_alg;
   
   h->next = h->start;
+  init_ext(ext);
+  reset_rovers(h);
   // printf("*h points to %ld, size is %ld, delta is %d, heap_start is %ld, heap_end is %ld\n", (long int)h, (long int)size, delta, (long int)h->start, (long int)(h->start + h->size));
   set_block_header(h->start, size, 0);
+  if (zero)
+    mark_block_zero(h->start);
   return h;
 }
+
 /*
- * Print the structure of the heap to the screen.
+ * Lay out a heap that is "size" bytes large, including its header, in
+ * the memory at heap_start. The private control state takes another
+ * sizeof(heap_ext) bytes just below the header.
  */
-void heap_print(heap *h)
+static heap *init_heap(void *heap_start, intptr_t size, search_alg_t search_alg,
+		       int zero)
 {
-  /* TO BE COMPLETED BY THE STUDENT. */
-  void* blk;
-  for(blk=h->start; is_within_heap_range(h, blk); blk=get_next_block(blk)){
-    printf("Block at address %lx\n", (long int)(blk + HEADER_SIZE));
-    printf("  Size: %d\n", (int)get_block_size(blk));
-    if(block_is_in_use(blk))
-      printf("  In use: Yes\n");
-    else
-      printf("  In use: No\n");  
+  /* Use the first part of the allocated space for the heap header */
+  return layout_heap(heap_start, heap_start + sizeof(heap_ext) + sizeof(heap),
+		     size - sizeof(heap), search_alg, zero);
+}
+
+/*
+ * Regions of heap_create heaps that heap_destroy could not return to the
+ * system, because memory above them was still in use. Each is described
+ * by a node at its start. Like sbrk itself, this is not thread-safe.
+ */
+typedef struct retired_region {
+  struct retired_region *next;
+  size_t len;
+} retired_region;
+
+static retired_region *retired_regions;
+
+/*
+ * Create a heap that is "size" bytes large, including its header. The
+ * private control state is allocated just below the header.
+ */
+heap *heap_create(intptr_t size, search_alg_t search_alg)
+{
+  size_t len = size + sizeof(heap_ext);
+  void *heap_start = NULL;
+  retired_region **r;
+  int zero = 0;
+  heap *h;
+
+  if (!heap_size_is_valid(size))
+    return NULL;
+
+  /* Reuse the region of a destroyed heap if one is large enough */
+  for (r = &retired_regions; *r != NULL; r = &(*r)->next) {
+    if ((*r)->len >= len) {
+      heap_start = *r;
+      len = (*r)->len;
+      *r = (*r)->next;
+      break;
+    }
+  }
+
+  /* Otherwise allocate space in the process' actual heap. Only the pages
+     past the old break are fresh; the rest of its page may be dirty. */
+  if (heap_start == NULL) {
+    heap_start = sbrk(len);
+    if (heap_start == (void *) -1) return NULL;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    size_t head = (-(uintptr_t) heap_start & (page - 1));
+    memset(heap_start, 0, head < len ? head : len);
+    zero = 1;
   }
+  h = init_heap(heap_start, size, search_alg, zero);
+  get_ext(h)->region_len = len;
+  return h;
 }
 
 /*
- * Determine the average size of all free blocks.
+ * Give back the sbrk region of a destroyed heap. Retired regions that end
+ * at the program break are returned to the system, until none is left.
  */
-block_size_t heap_find_avg_free_block_size(heap *h)
+static void retire_region(void *mem, size_t len)
 {
-  /* TO BE COMPLETED BY THE STUDENT. */
-  void* blk;
-  intptr_t count = 0;
-  block_size_t sum = 0;
-  for (blk = h->start; is_within_heap_range(h, blk); blk = get_next_block(blk)){
-    if(!block_is_in_use(blk)){
-      sum += get_block_size(blk);
-      count += 1;
+  retired_region *region = mem, **r;
+  region->len = len;
+  region->next = retired_regions;
+  retired_regions = region;
+
+  for (;;) {
+    void *brk = sbrk(0);
+    for (r = &retired_regions; *r != NULL; r = &(*r)->next)
+      if ((void *) *r + (*r)->len == brk)
+	break;
+    if (*r == NULL)
+      return;
+    region = *r;
+    *r = region->next;
+    if (sbrk(-(intptr_t) region->len) == (void *) -1) {
+      region->next = retired_regions;
+      retired_regions = region;
+      return;
     }
   }
-  return sum / count;
 }
 
 /*
- * Free a block on the heap h. Beware of the case where the  heap uses
- * a next fit search strategy, and h->next is pointing to a block that
- * is to be coalesced.
+ * NUMA memory policy that prefers, without requiring, a node (from
+ * <numaif.h>, which needs libnuma), and the largest node number
+ * heap_create_on_node binds to.
  */
-void heap_free(heap *h, void *payload)
+#define HEAP_MPOL_PREFERRED 1
+#define HEAP_MAX_NODES 1024
+
+/*
+ * Ask the kernel to place the pages of [addr, addr + len) on a NUMA node.
+ * The policy only prefers the node, so that allocation still succeeds
+ * when it runs out of memory. Failures, such as on kernels without NUMA
+ * support, are ignored: the memory is then placed by first touch.
+ */
+static void bind_to_node(void *addr, size_t len, int node)
 {
-  /* TO BE COMPLETED BY THE STUDENT. */
-  void* blk = get_block_start(payload);
-  block_size_t size = get_block_size(blk);
-  set_block_header(blk, size, 0);
-  blk = coalesce(h, blk);
-  coalesce(h, get_previous_block(blk));
+#ifdef SYS_mbind
+  unsigned long mask[HEAP_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+  if (node < 0 || node >= HEAP_MAX_NODES)
+    return;
+  mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+  syscall(SYS_mbind, addr, len, HEAP_MPOL_PREFERRED, mask, HEAP_MAX_NODES + 1, 0);
+#endif
 }
 
 /*
- * Malloc a block on the heap h, using first fit. Return NULL if no block
- * large enough to satisfy the request exits.
+ * Size of the huge pages heap_create_huge asks for, and the mmap flag
+ * selecting it (from <linux/mman.h>).
  */
-static void *malloc_first_fit(heap *h, block_size_t user_size)
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+/*
+ * Map len bytes aligned to align bytes, a power of two, by mapping more
+ * and unmapping the excess at both ends.
+ */
+static void *map_aligned(size_t len, size_t align)
 {
-  /* TO BE COMPLETED BY THE STUDENT. */
-  block_size_t real_size = get_size_to_allocate(user_size);
-  if(real_size == 2*HEADER_SIZE){
-    return NULL;
-  }
-  
-  void* blk;
-  void* payload;
-  for(blk = h->start; is_within_heap_range(h, blk); blk = get_next_block(blk)){
-    if(!block_is_in_use(blk) && get_block_size(blk) >= real_size){
-      blk = prepare_block_for_use(blk, real_size);
-      payload = get_payload(blk);
-      return payload;
-    }
-  }
+  char *mem = mmap(NULL, len + align, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char *aligned;
 
-  return NULL;
+  if (mem == MAP_FAILED)
+    return MAP_FAILED;
+  aligned = (char *) (((uintptr_t) mem + align - 1) & -(uintptr_t) align);
+  if (aligned > mem)
+    munmap(mem, aligned - mem);
+  munmap(aligned + len, mem + align - aligned);
+  return aligned;
 }
 
 /*
- * Malloc a block on the heap h, using best fit. Return NULL if no block
- * large enough to satisfy the request exits.
+ * Create a heap that is "size" bytes large in its own mapping. With huge
+ * set, the mapping is rounded up to whole 2 MiB pages, and backed by
+ * hugetlbfs pages if any are reserved, or else aligned for transparent
+ * huge pages. The heap keeps the requested size. With node
+ * non-negative, the pages are placed on that NUMA node.
  */
-static void *malloc_best_fit(heap *h, block_size_t user_size)
+static heap *create_mapped(intptr_t size, search_alg_t search_alg, int huge, int node)
 {
-  /* TO BE COMPLETED BY THE STUDENT. */
-  block_size_t real_size = get_size_to_allocate(user_size);
-  if(real_size == 2*HEADER_SIZE){
-    return NULL;
-  }
+  size_t len = size + sizeof(heap_ext);
+  int pages = HEAP_PAGES_NORMAL;
+  void *mem = MAP_FAILED;
+  heap *h;
 
-  void* blk;
-  void* best_blk = NULL;
-  block_size_t diff;
-  block_size_t best_diff = h->size;
-  for(blk = h->start; is_within_heap_range(h, blk); blk = get_next_block(blk)){
-    diff = get_block_size(blk) - real_size;
-    // printf("now diff is %d, best diff is %d\n", diff, best_diff);
-    if(!block_is_in_use(blk) && diff >= 0 && diff <= best_diff){
-      best_diff = diff;
-      best_blk = blk;
+  if (!heap_size_is_valid(size))
+    return NULL;
+  if (huge) {
+    len = (len + HUGE_PAGE_SIZE - 1) & -HUGE_PAGE_SIZE;
+#ifdef MAP_HUGETLB
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (mem != MAP_FAILED)
+      pages = HEAP_PAGES_HUGETLB;
+#endif
+    if (mem == MAP_FAILED) {
+      mem = map_aligned(len, HUGE_PAGE_SIZE);
+      if (mem != MAP_FAILED && madvise(mem, len, MADV_HUGEPAGE) == 0)
+	pages = HEAP_PAGES_TRANSPARENT;
     }
   }
-
-  if(best_blk != NULL){
-    best_blk = prepare_block_for_use(best_blk, real_size);
-    return get_payload(best_blk);
+  else {
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   }
-  else{
+  if (mem == MAP_FAILED)
     return NULL;
-  }
+
+  /* Bind before anything touches the pages */
+  if (node >= 0)
+    bind_to_node(mem, len, node);
+  h = init_heap(mem, size, search_alg, 1);
+  get_ext(h)->region = mem;
+  get_ext(h)->region_len = len;
+  get_ext(h)->pages = pages;
+  return h;
 }
 
 /*
- * Malloc a block on the heap h, using next fit. Return NULL if no block
- * large enough to satisfy the request exits.
+ * Create a heap that is "size" bytes large in its own mapping, with its
+ * pages placed on the given NUMA node where the system allows it.
  */
-static void *malloc_next_fit(heap *h, block_size_t user_size)
+heap *heap_create_on_node(intptr_t size, search_alg_t search_alg, int node)
 {
-  /* TO BE COMPLETED BY THE STUDENT. */
-  block_size_t real_size = get_size_to_allocate(user_size);
-  if(real_size == 2*HEADER_SIZE){
-    return NULL;
-  }
+  return create_mapped(size, search_alg, 0, node);
+}
 
-  void* blk;
-  void* payload;
-  for(blk = h->next; is_within_heap_range(h, blk); blk=get_next_block(blk)){
-    if(!block_is_in_use(blk) && get_block_size(blk)>=real_size){
-      blk = prepare_block_for_use(blk, real_size);
-      payload = get_payload(blk);
-      h->next = blk;
-      return payload;
-    }
-  }
+/*
+ * Create a heap backed by 2 MiB pages where the system provides them.
+ */
+heap *heap_create_huge(intptr_t size, search_alg_t search_alg)
+{
+  return create_mapped(size, search_alg, 1, -1);
+}
 
-  for(blk = h->start; blk != h->next; blk=get_next_block(blk)){
-    if(!block_is_in_use(blk) && get_block_size(blk)>=real_size){
-      blk = prepare_block_for_use(blk, real_size);
-      payload = get_payload(blk);
-      h->next = blk;
-      return payload;
-    }
+/*
+ * Size of a cache line, to which guarded heaps align their header.
+ */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Create a heap that is "size" bytes large in its own mapping, laid out
+ * as control state and header, a guard page, the block area and another
+ * guard page. The header starts a cache line. The block area ends where
+ * the trailing guard page starts, short of it only by the bytes that keep
+ * payloads aligned with tags narrower than PAYLOAD_ALIGN, so that writes
+ * past the last block fault; the slack of the rounding to whole pages is
+ * left at the start of the area instead.
+ */
+heap *heap_create_guarded(intptr_t size, search_alg_t search_alg)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t pad = -sizeof(heap_ext) & (CACHE_LINE_SIZE - 1);
+  size_t meta_len, area_len, len;
+  void *mem, *area_end;
+  heap *h;
+
+  if (!heap_size_is_valid(size))
+    return NULL;
+  meta_len = (pad + sizeof(heap_ext) + sizeof(heap) + page - 1) & -page;
+  area_len = (size - sizeof(heap) + page - 1) & -page;
+  len = meta_len + page + area_len + page;
+  mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+  if (mprotect(mem + meta_len, page, PROT_NONE) < 0
+      || mprotect(mem + len - page, page, PROT_NONE) < 0) {
+    munmap(mem, len);
+    return NULL;
   }
+  area_end = mem + len - page;
+  h = layout_heap(mem + pad, area_end - (size - sizeof(heap)), size - sizeof(heap),
+		  search_alg, 1);
+  get_ext(h)->region = mem;
+  get_ext(h)->region_len = len;
+  return h;
+}
 
-  return NULL;
+/*
+ * Return the kind of pages backing the heap.
+ */
+int heap_page_kind(heap *h)
+{
+  return get_ext(h)->pages;
 }
 
 /*
- * Our implementation of malloc.
+ * Return the number of NUMA nodes that may be online, at least 1.
  */
-void *heap_malloc(heap *h, block_size_t size)
+int heap_numa_nodes(void)
 {
-  switch (h->search_alg) {
-  case HEAP_FIRSTFIT:
-    return malloc_first_fit(h, size);
-  case HEAP_NEXTFIT:
-    return malloc_next_fit(h, size);
-  case HEAP_BESTFIT:
-    return malloc_best_fit(h, size);
+  FILE *f = fopen("/sys/devices/system/node/possible", "r");
+  char buf[256], *p;
+  int nodes = 1;
+
+  if (f == NULL)
+    return 1;
+  /* A list of ranges such as "0-3" or "0,2-3": find the largest number */
+  if (fgets(buf, sizeof(buf), f) != NULL) {
+    for (p = buf; *p != '\0'; ) {
+      if (*p >= '0' && *p <= '9') {
+	long n = strtol(p, &p, 10);
+	if (n + 1 > nodes)
+	  nodes = n < HEAP_MAX_NODES ? n + 1 : HEAP_MAX_NODES;
+      }
+      else {
+	p++;
+      }
+    }
+  }
+  fclose(f);
+  return nodes;
+}
+
+/*
+ * A thread-safe heap for each NUMA node.
+ */
+struct heap_arenas {
+  int nodes;
+  heap *heaps[];
+};
+
+/*
+ * Create a thread-safe heap of size_per_node bytes on each NUMA node.
+ */
+heap_arenas *heap_arenas_create(intptr_t size_per_node, search_alg_t search_alg)
+{
+  int nodes = heap_numa_nodes();
+  heap_arenas *a = malloc(sizeof(heap_arenas) + nodes * sizeof(heap *));
+  int i;
+
+  if (a == NULL)
+    return NULL;
+  a->nodes = nodes;
+  for (i = 0; i < nodes; i++) {
+    a->heaps[i] = heap_create_on_node(size_per_node, search_alg, i);
+    if (a->heaps[i] == NULL || heap_set_thread_safe(a->heaps[i]) < 0) {
+      a->nodes = i + (a->heaps[i] != NULL);
+      heap_arenas_destroy(a);
+      return NULL;
+    }
+  }
+  return a;
+}
+
+/*
+ * Return the heap of the NUMA node the calling thread runs on, or of node
+ * 0 if it cannot be determined.
+ */
+heap *heap_arenas_select(heap_arenas *a)
+{
+  unsigned cpu, node = 0;
+#ifdef SYS_getcpu
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0 || node >= (unsigned) a->nodes)
+    node = 0;
+#endif
+  return a->heaps[node];
+}
+
+/*
+ * Return the heap of the arena set that holds payload, or NULL.
+ */
+heap *heap_arenas_owner(heap_arenas *a, void *payload)
+{
+  int i;
+  for (i = 0; i < a->nodes; i++)
+    if (is_within_heap_range(a->heaps[i], get_block_start(payload)))
+      return a->heaps[i];
+  return NULL;
+}
+
+/*
+ * Destroy every heap of a set of arenas, and the set.
+ */
+void heap_arenas_destroy(heap_arenas *a)
+{
+  int i;
+  for (i = 0; i < a->nodes; i++)
+    heap_destroy(a->heaps[i]);
+  free(a);
+}
+
+/*
+ * Offset of the first block in a mapped region that begins with a header
+ * of the given type: past the header, with the payload aligned to
+ * PAYLOAD_ALIGN.
+ */
+#define REGION_START(header_type) \
+  ((sizeof(header_type) + HEADER_SIZE + PAYLOAD_ALIGN - 1) / PAYLOAD_ALIGN \
+   * PAYLOAD_ALIGN - HEADER_SIZE)
+
+/*
+ * Header at the start of the region of a shared heap. Every process maps
+ * the region at its own address, so the header holds offsets only, and
+ * the state that struct heap keeps as pointers is copied in and out of it
+ * under the lock.
+ */
+#define HEAP_SHARED_MAGIC 0x64726873 /* "shrd" */
+
+typedef struct heap_shared_header {
+  pthread_mutex_t lock;             /* Robust, process-shared lock. */
+  uint32_t magic;                   /* HEAP_SHARED_MAGIC. */
+  uint32_t tag_bits;                /* HEAP_TAG_BITS of the creator. */
+  uint64_t start;                   /* Offset of the first block in the region. */
+  uint64_t size;                    /* Size of the block area in bytes. */
+  uint64_t next;                    /* Offset of h->next from the first block. */
+  int32_t flags;                    /* HEAP_HARDEN_* options. */
+  int32_t error;                    /* Set when a process died and left it corrupted. */
+} heap_shared_header;
+
+static heap_error_t check_blocks(heap *h, heap_check_level_t level);
+
+/*
+ * Take the lock of a thread-safe or shared heap, and load the state of a
+ * shared heap into h. If the previous owner of a shared heap died holding
+ * the lock, the blocks it may have been changing are checked, and the
+ * heap is marked unusable if they are corrupted. Does nothing for heaps
+ * without a lock.
+ */
+static heap_error_t lock_heap(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  heap_shared_header *sh = ext->shared;
+  int err;
+
+  if (ext->lock == NULL)
+    return HEAP_OK;
+  err = pthread_mutex_lock(ext->lock);
+  if (err == EOWNERDEAD) {
+    sh->next = 0;
+    h->next = h->start;
+    if (sh->error == HEAP_OK)
+      sh->error = check_blocks(h, HEAP_CHECK_FAST);
+    pthread_mutex_consistent(ext->lock);
+  }
+  else if (err != 0) {
+    return HEAP_ERR_LOCK;
+  }
+  if (sh == NULL)
+    return HEAP_OK;
+  if (sh->error != HEAP_OK) {
+    pthread_mutex_unlock(ext->lock);
+    return sh->error;
+  }
+  /* Other processes may have merged away the blocks the rovers were at */
+  h->next = h->start + sh->next;
+  reset_rovers(h);
+  ext->flags = sh->flags;
+  return HEAP_OK;
+}
+
+/*
+ * Store the state of a shared heap and release the lock of the heap.
+ */
+static void unlock_heap(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  if (ext->lock == NULL)
+    return;
+  if (ext->shared != NULL)
+    ext->shared->next = h->next - h->start;
+  pthread_mutex_unlock(ext->lock);
+}
+
+/*
+ * Make every operation on a private heap take a lock, so that several
+ * threads can use it.
+ */
+int heap_set_thread_safe(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  int err;
+
+  if (ext->lock != NULL)
+    return 0;
+  err = pthread_mutex_init(&ext->local_lock, NULL);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  ext->lock = &ext->local_lock;
+  return 0;
+}
+
+/*
+ * Sizes of the tables of the sampling profiler. Call sites and sampled
+ * blocks that are still allocated live in open addressing hash tables;
+ * samples that do not fit are counted as dropped. Size classes are powers
+ * of two: class i holds requests of more than 2^(i-1) and up to 2^i bytes.
+ */
+#define PROFILE_SITES 1024
+#define PROFILE_LIVE 8192
+#define PROFILE_CLASSES (8 * sizeof(block_size_t) + 1)
+
+/*
+ * A sampled block that is still allocated.
+ */
+typedef struct profile_sample {
+  void *payload;                    /* Payload of the block, or NULL. */
+  uint32_t site;                    /* Index of its call site. */
+  uint32_t size_class;              /* Size class of the request. */
+  uint64_t time_ns;                 /* Time of the allocation. */
+} profile_sample;
+
+/*
+ * State of the profiler of a heap, mapped by heap_profile_start.
+ */
+typedef struct heap_profile {
+  unsigned rate;                    /* Mean number of mallocs per sample. */
+  unsigned countdown;               /* Mallocs left until the next sample. */
+  uint64_t rng;                     /* State of the interval generator. */
+  uint64_t samples;                 /* Samples recorded. */
+  uint64_t dropped;                 /* Samples lost to a full table. */
+  size_t live_len;                  /* Used slots of live. */
+  heap_profile_entry classes[PROFILE_CLASSES];
+  heap_profile_entry sites[PROFILE_SITES];
+  profile_sample live[PROFILE_LIVE];
+} heap_profile;
+
+/*
+ * Return the time in nanoseconds on the monotonic clock.
+ */
+static uint64_t profile_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Draw the number of mallocs until the next sample, uniformly from
+ * [1, 2 * rate - 1] so that sampling does not lock onto periodic patterns.
+ */
+static unsigned profile_interval(heap_profile *p)
+{
+  if (p->rate <= 1)
+    return 1;
+  p->rng ^= p->rng << 13;
+  p->rng ^= p->rng >> 7;
+  p->rng ^= p->rng << 17;
+  return 1 + p->rng % (2 * (uint64_t) p->rate - 1);
+}
+
+/*
+ * Return the size class of a request.
+ */
+static uint32_t profile_class(block_size_t size)
+{
+  return size <= 1 ? 0 : 64 - __builtin_clzll((uint64_t) size - 1);
+}
+
+/*
+ * Return the slot of payload in the live table, or of the empty slot
+ * where it would go.
+ */
+static size_t profile_live_slot(heap_profile *p, void *payload)
+{
+  size_t i = ((uintptr_t) payload / PAYLOAD_ALIGN * 0x9e3779b97f4a7c15ULL) % PROFILE_LIVE;
+  while (p->live[i].payload != NULL && p->live[i].payload != payload)
+    i = (i + 1) % PROFILE_LIVE;
+  return i;
+}
+
+/*
+ * Empty slot i of the live table, moving back the samples after it that
+ * would no longer be found.
+ */
+static void profile_live_remove(heap_profile *p, size_t i)
+{
+  size_t j = i;
+  for (;;) {
+    j = (j + 1) % PROFILE_LIVE;
+    if (p->live[j].payload == NULL)
+      break;
+    size_t home = ((uintptr_t) p->live[j].payload / PAYLOAD_ALIGN
+		   * 0x9e3779b97f4a7c15ULL) % PROFILE_LIVE;
+    /* Move the sample unless its home lies cyclically in (i, j] */
+    if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+      p->live[i] = p->live[j];
+      i = j;
+    }
+  }
+  p->live[i].payload = NULL;
+  p->live_len--;
+}
+
+/*
+ * Add a sampled malloc of "size" bytes to a profile entry.
+ */
+static void count_profile_sample(heap_profile_entry *e, block_size_t size)
+{
+  e->allocs++;
+  e->bytes += size;
+  if (size > e->max_size)
+    e->max_size = size;
+}
+
+/*
+ * Count a malloc of "size" bytes from site, sampling it when its turn
+ * has come.
+ */
+static void profile_malloc(heap_profile *p, void *payload, block_size_t size, void *site)
+{
+  size_t i, n;
+  uint32_t size_class;
+
+  if (--p->countdown > 0)
+    return;
+  p->countdown = profile_interval(p);
+
+  i = ((uintptr_t) site * 0x9e3779b97f4a7c15ULL) % PROFILE_SITES;
+  for (n = 0; p->sites[i].site != NULL && p->sites[i].site != site; n++) {
+    if (n == PROFILE_SITES) {
+      p->dropped++;
+      return;
+    }
+    i = (i + 1) % PROFILE_SITES;
+  }
+  size_class = profile_class(size);
+  p->samples++;
+  p->sites[i].site = site;
+  count_profile_sample(&p->sites[i], size);
+  count_profile_sample(&p->classes[size_class], size);
+
+  /* Keep the live table sparse enough for short probes */
+  if (p->live_len >= PROFILE_LIVE * 3 / 4) {
+    p->dropped++;
+    return;
+  }
+  n = profile_live_slot(p, payload);
+  if (p->live[n].payload == NULL)
+    p->live_len++;
+  p->live[n] = (profile_sample) { payload, i, size_class, profile_now() };
+}
+
+/*
+ * Record the lifetime of payload if it was sampled.
+ */
+static void profile_free(heap_profile *p, void *payload)
+{
+  size_t i;
+  uint64_t lifetime;
+
+  if (p->live_len == 0)
+    return;
+  i = profile_live_slot(p, payload);
+  if (p->live[i].payload == NULL)
+    return;
+  lifetime = profile_now() - p->live[i].time_ns;
+  p->sites[p->live[i].site].frees++;
+  p->sites[p->live[i].site].lifetime_ns += lifetime;
+  p->classes[p->live[i].size_class].frees++;
+  p->classes[p->live[i].size_class].lifetime_ns += lifetime;
+  profile_live_remove(p, i);
+}
+
+/*
+ * Follow a sampled block that realloc moved to new_payload.
+ */
+static void profile_move(heap_profile *p, void *payload, void *new_payload)
+{
+  size_t i;
+  profile_sample s;
+
+  if (p->live_len == 0)
+    return;
+  i = profile_live_slot(p, payload);
+  if (p->live[i].payload == NULL)
+    return;
+  s = p->live[i];
+  profile_live_remove(p, i);
+  i = profile_live_slot(p, new_payload);
+  if (p->live[i].payload == NULL)
+    p->live_len++;
+  s.payload = new_payload;
+  p->live[i] = s;
+}
+
+/*
+ * Release the profiler of a heap.
+ */
+static void profile_release(heap_ext *ext)
+{
+  if (ext->profile == NULL)
+    return;
+  munmap(ext->profile, sizeof(heap_profile));
+  ext->profile = NULL;
+}
+
+/*
+ * Start sampling 1 in about rate mallocs, mapping the profiler on first
+ * use. Samples taken so far are kept when the rate changes.
+ */
+int heap_profile_start(heap *h, unsigned rate)
+{
+  heap_ext *ext = get_ext(h);
+  heap_profile *p;
+
+  if (rate == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (lock_heap(h) != HEAP_OK)
+    return -1;
+  p = ext->profile;
+  if (p == NULL) {
+    p = mmap(NULL, sizeof(heap_profile), PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      unlock_heap(h);
+      return -1;
+    }
+    p->rng = profile_now() ^ (uintptr_t) h;
+    if (p->rng == 0)
+      p->rng = 1;
+    ext->profile = p;
+  }
+  p->rate = rate;
+  p->countdown = profile_interval(p);
+  unlock_heap(h);
+  return 0;
+}
+
+/*
+ * Stop sampling and release the profiler with its samples.
+ */
+void heap_profile_stop(heap *h)
+{
+  if (lock_heap(h) != HEAP_OK)
+    return;
+  profile_release(get_ext(h));
+  unlock_heap(h);
+}
+
+/*
+ * Order profile entries by bytes, most first.
+ */
+static int compare_profile_entries(const void *a, const void *b)
+{
+  const heap_profile_entry *x = a, *y = b;
+  return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+/*
+ * Copy the used call site or size class entries of the profiler into
+ * entries, sorted. Return how many there are.
+ */
+static size_t copy_profile_entries(heap *h, int sites, heap_profile_entry *entries,
+				   size_t max)
+{
+  heap_profile_entry all[PROFILE_SITES];
+  heap_profile_entry *table;
+  size_t i, len, n = 0;
+
+  if (lock_heap(h) != HEAP_OK)
+    return 0;
+  if (get_ext(h)->profile == NULL) {
+    unlock_heap(h);
+    return 0;
+  }
+  table = sites ? get_ext(h)->profile->sites : get_ext(h)->profile->classes;
+  len = sites ? PROFILE_SITES : PROFILE_CLASSES;
+  for (i = 0; i < len; i++)
+    if (table[i].allocs > 0)
+      all[n++] = table[i];
+  unlock_heap(h);
+
+  qsort(all, n, sizeof(all[0]), compare_profile_entries);
+  memcpy(entries, all, (n < max ? n : max) * sizeof(all[0]));
+  return n;
+}
+
+/*
+ * Report the sampled call sites, or size classes, most bytes first.
+ */
+size_t heap_profile_sites(heap *h, heap_profile_entry *entries, size_t max)
+{
+  return copy_profile_entries(h, 1, entries, max);
+}
+
+size_t heap_profile_classes(heap *h, heap_profile_entry *entries, size_t max)
+{
+  return copy_profile_entries(h, 0, entries, max);
+}
+
+/*
+ * Write one line of a profile report. Counts and bytes are estimates for
+ * all mallocs, the lifetime is the mean over the freed samples.
+ */
+static void report_profile_entry(int fd, const char *label, heap_profile_entry *e,
+				 unsigned rate)
+{
+  dprintf(fd, "%-40s %12" PRIu64 " %14" PRIu64 " %10" PRIu64 " %12" PRIu64 " %14" PRIu64 "\n",
+	  label, e->allocs * rate, e->bytes * rate, e->max_size, e->frees * rate,
+	  e->frees ? e->lifetime_ns / e->frees : 0);
+}
+
+/*
+ * Write the sampled call sites, named with dladdr where possible, and the
+ * sampled size classes to fd.
+ */
+int heap_profile_report(heap *h, int fd)
+{
+  heap_profile_entry entries[PROFILE_SITES];
+  char label[64];
+  uint64_t samples, dropped;
+  unsigned rate;
+  size_t i, n;
+  Dl_info info;
+
+  if (lock_heap(h) != HEAP_OK)
+    return -1;
+  if (get_ext(h)->profile == NULL) {
+    unlock_heap(h);
+    errno = EINVAL;
+    return -1;
+  }
+  rate = get_ext(h)->profile->rate;
+  samples = get_ext(h)->profile->samples;
+  dropped = get_ext(h)->profile->dropped;
+  unlock_heap(h);
+
+  if (dprintf(fd, "Heap profile: 1 in %u mallocs sampled, %" PRIu64 " samples, %"
+	      PRIu64 " dropped\n", rate, samples, dropped) < 0)
+    return -1;
+  dprintf(fd, "%-40s %12s %14s %10s %12s %14s\n", "Call site", "Allocs", "Bytes",
+	  "Largest", "Frees", "Lifetime (ns)");
+  n = heap_profile_sites(h, entries, PROFILE_SITES);
+  for (i = 0; i < n; i++) {
+    if (dladdr(entries[i].site, &info) && info.dli_sname != NULL)
+      snprintf(label, sizeof(label), "%s+%#tx", info.dli_sname,
+	       (char *) entries[i].site - (char *) info.dli_saddr);
+    else
+      snprintf(label, sizeof(label), "%p", entries[i].site);
+    report_profile_entry(fd, label, &entries[i], rate);
+  }
+  dprintf(fd, "%-40s %12s %14s %10s %12s %14s\n", "Size class", "Allocs", "Bytes",
+	  "Largest", "Frees", "Lifetime (ns)");
+  n = heap_profile_classes(h, entries, PROFILE_SITES);
+  for (i = 0; i < n; i++) {
+    uint32_t size_class = profile_class(entries[i].max_size);
+    snprintf(label, sizeof(label), "%" PRIu64 "-%" PRIu64 " bytes",
+	     size_class == 0 ? 0 : ((uint64_t) 1 << (size_class - 1)) + 1,
+	     (uint64_t) 1 << size_class);
+    report_profile_entry(fd, label, &entries[i], rate);
+  }
+  return 0;
+}
+
+/*
+ * Wait, with the heap lock held, until no maintenance pass has the lock
+ * dropped. Such a pass may hold free blocks of the heap marked in use.
+ */
+static void wait_for_pass(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  while (ext->in_pass) {
+    unlock_heap(h);
+    sched_yield();
+    lock_heap(h);
+  }
+}
+
+/*
+ * Turn the heap back into a single free block, dropping quarantined
+ * blocks and queued remote frees, without walking the heap.
+ */
+int heap_reset(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  if (lock_heap(h) != HEAP_OK)
+    return -1;
+  wait_for_pass(h);
+  set_block_header(h->start, h->size, 0);
+  h->next = h->start;
+  reset_rovers(h);
+  invalidate_hints(h);
+  ext->quarantine_head = 0;
+  ext->quarantine_len = 0;
+  __atomic_store_n(&ext->remote_frees, NULL, __ATOMIC_RELAXED);
+  if (ext->profile != NULL) {
+    memset(ext->profile->live, 0, sizeof(ext->profile->live));
+    ext->profile->live_len = 0;
+  }
+  if (ext->table_tags != NULL) {
+    ext->table_len = 1;
+    ext->table_offsets[0] = 0;
+    ext->table_tags[0] = *((block_size_t *) h->start);
+  }
+  unlock_heap(h);
+  return 0;
+}
+
+/*
+ * Release a heap that is not persistent or shared, with its side table
+ * and lock.
+ */
+int heap_destroy(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  if (ext->fd >= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  heap_stop_maintenance(h);
+  heap_disable_side_table(h);
+  profile_release(ext);
+  if (ext->lock != NULL)
+    pthread_mutex_destroy(ext->lock);
+  if (ext->region != NULL)
+    return munmap(ext->region, ext->region_len);
+  retire_region(ext, ext->region_len);
+  return 0;
+}
+
+/*
+ * Print the structure of the heap to the screen.
+ */
+void heap_print(heap *h)
+{
+  /* TO BE COMPLETED BY THE STUDENT. */
+  block_walk w;
+  void* blk;
+  if(lock_heap(h) != HEAP_OK)
+    return;
+  for(blk = walk_start(&w, h, h->start, h->start + h->size, 0); blk; blk = walk_next(&w)){
+    printf("Block at address %lx\n", (long int)(blk + HEADER_SIZE));
+    printf("  Size: %" PRIu64 "\n", (uint64_t)get_block_size(blk));
+    if(block_is_in_use(blk))
+      printf("  In use: Yes\n");
+    else
+      printf("  In use: No\n");  
+  }
+  unlock_heap(h);
+}
+
+/*
+ * Determine the average size of all free blocks.
+ */
+block_size_t heap_find_avg_free_block_size(heap *h)
+{
+  /* TO BE COMPLETED BY THE STUDENT. */
+  block_walk w;
+  void* blk;
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  if(lock_heap(h) != HEAP_OK)
+    return 0;
+  for(blk = walk_start(&w, h, h->start, h->start + h->size, 1); blk; blk = walk_next(&w)){
+    sum += get_block_size(blk);
+    count += 1;
+  }
+  unlock_heap(h);
+  if(count == 0){
+    return 0;
+  }
+  return sum / count;
+}
+
+/*
+ * Number of run records buffered by heap_snapshot before each write.
+ */
+#define SNAPSHOT_BUFFER_RUNS 256
+
+/*
+ * Write len bytes from buf to fd, retrying on short writes and
+ * interruptions. Return 0 on success, -1 on error.
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Append one run record to the snapshot buffer, flushing it to fd when it
+ * fills up. Return 0 on success, -1 if the write failed.
+ */
+static int snapshot_emit(int fd, heap_snapshot_run *buf, int *count,
+			 heap_snapshot_run *run)
+{
+  buf[(*count)++] = *run;
+  if (*count < SNAPSHOT_BUFFER_RUNS)
+    return 0;
+  *count = 0;
+  return write_all(fd, buf, SNAPSHOT_BUFFER_RUNS * sizeof(heap_snapshot_run));
+}
+
+/*
+ * Stream a binary snapshot of the heap to fd. Adjacent blocks in the same
+ * state are merged into a single run, so the output is proportional to the
+ * number of free/used transitions rather than the number of blocks.
+ */
+static int snapshot_blocks(heap *h, int fd)
+{
+  heap_snapshot_header hdr = { HEAP_SNAPSHOT_MAGIC, HEAP_SNAPSHOT_VERSION,
+			       (uint64_t) h->size };
+  heap_snapshot_run buf[SNAPSHOT_BUFFER_RUNS];
+  heap_snapshot_run run = { 0, 0, 0, 0 };
+  int count = 0;
+  void *blk;
+
+  if (write_all(fd, &hdr, sizeof(hdr)) < 0)
+    return -1;
+
+  for (blk = h->start; is_within_heap_range(h, blk); blk = get_next_block(blk)) {
+    block_size_t size = get_block_size(blk);
+    uint32_t in_use = block_is_in_use(blk);
+    if (size == 0)
+      return -1; /* corrupted header, the walk would never terminate */
+
+    if (run.blocks > 0 && run.in_use != in_use) {
+      if (snapshot_emit(fd, buf, &count, &run) < 0)
+	return -1;
+      run.blocks = 0;
+    }
+    if (run.blocks == 0) {
+      run.offset = blk - h->start;
+      run.size = 0;
+      run.in_use = in_use;
+    }
+    run.size += size;
+    run.blocks++;
+  }
+
+  if (run.blocks > 0 && snapshot_emit(fd, buf, &count, &run) < 0)
+    return -1;
+  return write_all(fd, buf, count * sizeof(heap_snapshot_run));
+}
+
+/*
+ * Write a snapshot of the heap to fd.
+ */
+int heap_snapshot(heap *h, int fd)
+{
+  int ret;
+  if (lock_heap(h) != HEAP_OK)
+    return -1;
+  ret = snapshot_blocks(h, fd);
+  unlock_heap(h);
+  return ret;
+}
+
+/*
+ * Verify the consistency of the heap. Every block size is validated before
+ * it is used to advance, so a corrupted heap cannot send the walk out of
+ * the heap range or into an endless loop.
+ */
+static heap_error_t check_blocks(heap *h, heap_check_level_t level)
+{
+  heap_ext *ext = get_ext(h);
+  void *end = h->start + h->size;
+  void *blk, *hint_target = NULL;
+  walk_hint *hint;
+  int prev_free = 0;
+  int next_found = 0;
+  unsigned rovers_found = 0;
+  size_t index = 0;
+  int i;
+
+  for (blk = h->start; blk < end; blk = get_next_block(blk)) {
+    block_size_t size = get_block_size(blk);
+    if (size < 2 * HEADER_SIZE)
+      return HEAP_ERR_SIZE;
+    if (size > end - blk)
+      return HEAP_ERR_TOTAL;
+    if (*((block_size_t *) blk) != *((block_size_t *) (blk + size - HEADER_SIZE)))
+      return HEAP_ERR_FOOTER;
+
+    if (level == HEAP_CHECK_DEEP) {
+      int is_free = !block_is_in_use(blk);
+      if (prev_free && is_free)
+	return HEAP_ERR_ADJACENT_FREE;
+      if (size % PAYLOAD_ALIGN != 0
+	  || (uintptr_t) get_payload(blk) % PAYLOAD_ALIGN != 0)
+	return HEAP_ERR_ALIGN;
+      if (blk == h->next)
+	next_found = 1;
+      for (i = 0; i < ROVER_CLASSES; i++)
+	if (blk == ext->rovers[i])
+	  rovers_found |= 1u << i;
+      prev_free = is_free;
+      /* A valid walk hint must lead to the next free block */
+      if (hint_target == blk)
+	hint_target = NULL;
+      else if (hint_target != NULL && (blk > hint_target || is_free))
+	return HEAP_ERR_HINT;
+      if (is_free && (hint = get_hint(h, blk)) != NULL)
+	hint_target = get_next_block(blk) + hint->skip;
+      if (ext->table_tags != NULL
+	  && (index >= ext->table_len
+	      || ext->table_offsets[index] != blk - h->start
+	      || ext->table_tags[index] != *((block_size_t *) blk)))
+	return HEAP_ERR_TABLE;
+      index++;
+    }
+  }
+
+  if (level == HEAP_CHECK_DEEP
+      && (!next_found || rovers_found != (1u << ROVER_CLASSES) - 1))
+    return HEAP_ERR_NEXT;
+  if (level == HEAP_CHECK_DEEP && hint_target != NULL && hint_target != end)
+    return HEAP_ERR_HINT;
+  if (level == HEAP_CHECK_DEEP && ext->table_tags != NULL && index != ext->table_len)
+    return HEAP_ERR_TABLE;
+  return HEAP_OK;
+}
+
+/*
+ * Verify the consistency of the heap in a single walk.
+ */
+heap_error_t heap_check(heap *h, heap_check_level_t level)
+{
+  heap_error_t err = lock_heap(h);
+  if (err != HEAP_OK)
+    return err;
+  err = check_blocks(h, level);
+  unlock_heap(h);
+  return err;
+}
+
+/*
+ * Return the index of the side table entry for the block at blk. The
+ * offsets are sorted, so this is a binary search.
+ */
+static size_t table_find(heap *h, void *blk)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t offset = blk - h->start;
+  size_t lo = 0, hi = ext->table_len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ext->table_offsets[mid] < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Insert an entry for the block at blk at index i of the side table.
+ */
+static void table_insert(heap *h, size_t i, void *blk)
+{
+  heap_ext *ext = get_ext(h);
+  size_t n = ext->table_len - i;
+  memmove(ext->table_tags + i + 1, ext->table_tags + i, n * sizeof(block_size_t));
+  memmove(ext->table_offsets + i + 1, ext->table_offsets + i, n * sizeof(block_size_t));
+  ext->table_tags[i] = *((block_size_t *) blk);
+  ext->table_offsets[i] = blk - h->start;
+  ext->table_len++;
+}
+
+/*
+ * Remove entry i of the side table.
+ */
+static void table_remove(heap *h, size_t i)
+{
+  heap_ext *ext = get_ext(h);
+  size_t n = ext->table_len - i - 1;
+  memmove(ext->table_tags + i, ext->table_tags + i + 1, n * sizeof(block_size_t));
+  memmove(ext->table_offsets + i, ext->table_offsets + i + 1, n * sizeof(block_size_t));
+  ext->table_len--;
+}
+
+/*
+ * Fill the side table from the block headers. Return 0 on success, -1 if
+ * the heap is corrupted or has more blocks than the table can hold.
+ */
+static int table_rebuild(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  void *blk;
+  ext->table_len = 0;
+  for (blk = h->start; is_within_heap_range(h, blk); blk = get_next_block(blk)) {
+    if (get_block_size(blk) == 0 || ext->table_len == ext->table_cap)
+      return -1;
+    ext->table_tags[ext->table_len] = *((block_size_t *) blk);
+    ext->table_offsets[ext->table_len] = blk - h->start;
+    ext->table_len++;
+  }
+  return 0;
+}
+
+/*
+ * Find the first entry at index from or later that is a free block of at
+ * least real_size bytes. Return len if there is none.
+ */
+static size_t table_scan_scalar(const block_size_t *tags, size_t from, size_t len,
+				block_size_t real_size)
+{
+  size_t i;
+  for (i = from; i < len; i++)
+    if (!(tags[i] & 1) && tags[i] >= real_size)
+      return i;
+  return len;
+}
+
+#ifdef SIDE_TABLE_SIMD
+/*
+ * SSE2 version of table_scan_scalar, 8 entries per iteration. SSE2 has no
+ * unsigned compare, so both sides are biased by 2^31 first.
+ */
+static size_t table_scan_sse2(const block_size_t *tags, size_t from, size_t len,
+			      block_size_t real_size)
+{
+  const __m128i bias = _mm_set1_epi32(INT32_MIN);
+  const __m128i limit = _mm_set1_epi32((int32_t) ((real_size - 1) ^ 0x80000000u));
+  const __m128i one = _mm_set1_epi32(1);
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = from;
+
+  for (; i + 8 <= len; i += 8) {
+    __m128i t0 = _mm_loadu_si128((const __m128i *) (tags + i));
+    __m128i t1 = _mm_loadu_si128((const __m128i *) (tags + i + 4));
+    __m128i m0 = _mm_and_si128(_mm_cmpgt_epi32(_mm_xor_si128(t0, bias), limit),
+			       _mm_cmpeq_epi32(_mm_and_si128(t0, one), zero));
+    __m128i m1 = _mm_and_si128(_mm_cmpgt_epi32(_mm_xor_si128(t1, bias), limit),
+			       _mm_cmpeq_epi32(_mm_and_si128(t1, one), zero));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(m0))
+      | _mm_movemask_ps(_mm_castsi128_ps(m1)) << 4;
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return table_scan_scalar(tags, i, len, real_size);
+}
+
+/*
+ * AVX2 version of table_scan_scalar, 16 entries per iteration.
+ */
+__attribute__((target("avx2")))
+static size_t table_scan_avx2(const block_size_t *tags, size_t from, size_t len,
+			      block_size_t real_size)
+{
+  const __m256i limit = _mm256_set1_epi32((int32_t) real_size);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = from;
+
+  for (; i + 16 <= len; i += 16) {
+    __m256i t0 = _mm256_loadu_si256((const __m256i *) (tags + i));
+    __m256i t1 = _mm256_loadu_si256((const __m256i *) (tags + i + 8));
+    __m256i m0 = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(t0, limit), t0),
+				  _mm256_cmpeq_epi32(_mm256_and_si256(t0, one), zero));
+    __m256i m1 = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(t1, limit), t1),
+				  _mm256_cmpeq_epi32(_mm256_and_si256(t1, one), zero));
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(m0))
+      | _mm256_movemask_ps(_mm256_castsi256_ps(m1)) << 8;
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return table_scan_sse2(tags, i, len, real_size);
+}
+#endif
+
+/*
+ * Scan kernel used for side tables, picked for the CPU once, by the first
+ * heap_enable_side_table of the process.
+ */
+static size_t (*table_scan)(const block_size_t *tags, size_t from, size_t len,
+			    block_size_t real_size) = table_scan_scalar;
+static pthread_once_t table_scan_once = PTHREAD_ONCE_INIT;
+
+static void pick_table_scan(void)
+{
+#ifdef SIDE_TABLE_SIMD
+  table_scan = __builtin_cpu_supports("avx2") ? table_scan_avx2 : table_scan_sse2;
+#endif
+}
+
+/*
+ * Turn the free block at side table index i into one the user can
+ * utilize, and update the table for the split if there is one.
+ */
+static void *table_claim(heap *h, size_t i, block_size_t real_size)
+{
+  heap_ext *ext = get_ext(h);
+  void *blk = h->start + ext->table_offsets[i];
+  block_size_t old_size = get_block_size(blk);
+
+  claim_block(h, blk, real_size);
+  ext->table_tags[i] = *((block_size_t *) blk);
+  if (get_block_size(blk) != old_size)
+    table_insert(h, i + 1, get_next_block(blk));
+  return blk;
+}
+
+/*
+ * Malloc a block on the heap h using the side table instead of walking
+ * the headers. Follows the same policies as the malloc_*_fit functions.
+ */
+static void *malloc_side_table(heap *h, block_size_t user_size)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t real_size = get_size_to_allocate(user_size);
+  size_t len = ext->table_len;
+  size_t i, found;
+  void *blk, **rover;
+
+  if (real_size <= 2 * HEADER_SIZE) // empty or oversized request
+    return NULL;
+
+  switch (h->search_alg) {
+  case HEAP_NEXTFIT:
+  case HEAP_SEGNEXTFIT:
+    rover = get_rover(h, real_size);
+    i = table_find(h, *rover);
+    found = table_scan(ext->table_tags, i, len, real_size);
+    if (found == len) {
+      found = table_scan(ext->table_tags, 0, i, real_size);
+      if (found == i)
+	return NULL;
+    }
+    blk = table_claim(h, found, real_size);
+    *rover = blk;
+    return get_payload(blk);
+
+  case HEAP_BESTFIT:
+    found = len;
+    for (i = table_scan(ext->table_tags, 0, len, real_size); i < len;
+	 i = table_scan(ext->table_tags, i + 1, len, real_size)) {
+      if (found == len || ext->table_tags[i] <= ext->table_tags[found])
+	found = i;
+    }
+    if (found == len)
+      return NULL;
+    return get_payload(table_claim(h, found, real_size));
+
+  default:
+    found = table_scan(ext->table_tags, 0, len, real_size);
+    if (found == len)
+      return NULL;
+    return get_payload(table_claim(h, found, real_size));
+  }
+}
+
+/*
+ * Stop maintaining the side table and release its memory.
+ */
+static void disable_side_table(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  if (ext->table_tags == NULL)
+    return;
+  munmap(ext->table_tags, 2 * ext->table_cap * sizeof(block_size_t));
+  ext->table_tags = NULL;
+  ext->table_offsets = NULL;
+  ext->table_len = 0;
+  ext->table_cap = 0;
+}
+
+void heap_disable_side_table(heap *h)
+{
+  if (lock_heap(h) != HEAP_OK)
+    return;
+  disable_side_table(h);
+  unlock_heap(h);
+}
+
+/*
+ * Keep a side table of the blocks of the heap for vectorized free block
+ * searches. The table is reserved for the largest possible number of
+ * blocks, but only the part in use is backed by memory.
+ */
+static int enable_side_table(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  size_t cap = h->size / (2 * HEADER_SIZE) + 1;
+  void *table;
+
+  if (ext->table_tags != NULL)
+    return 0;
+  if (ext->shared != NULL)
+    return -1; /* other processes would not keep it up to date */
+  table = mmap(NULL, 2 * cap * sizeof(block_size_t), PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (table == MAP_FAILED)
+    return -1;
+
+  pthread_once(&table_scan_once, pick_table_scan);
+  ext->table_tags = table;
+  ext->table_offsets = ext->table_tags + cap;
+  ext->table_cap = cap;
+  if (table_rebuild(h) < 0) {
+    disable_side_table(h);
+    return -1;
+  }
+  return 0;
+}
+
+int heap_enable_side_table(heap *h)
+{
+  int ret;
+  if (lock_heap(h) != HEAP_OK)
+    return -1;
+  ret = enable_side_table(h);
+  unlock_heap(h);
+  return ret;
+}
+
+/*
+ * Return a block to the free pool, merging it with its free neighbours.
+ * Beware of the case where the heap uses a next fit search strategy, and
+ * h->next or a rover is pointing to a block that is to be coalesced.
+ */
+static void release_block(heap *h, void *blk)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t size = get_block_size(blk);
+  set_block_header(blk, size, 0);
+  invalidate_hints(h);
+
+  if (ext->table_tags == NULL) {
+    blk = coalesce(h, blk);
+    if (!is_first_block(h, blk) && !block_is_in_use(get_previous_block(blk)))
+      blk = coalesce(h, get_previous_block(blk));
+    pull_rovers(h, blk);
+    return;
+  }
+
+  /* Merge the side table entries the same way as the blocks */
+  size_t i = table_find(h, blk);
+  void *next = get_next_block(blk);
+  if (is_within_heap_range(h, next) && !block_is_in_use(next))
+    table_remove(h, i + 1);
+  blk = coalesce(h, blk);
+  if (!is_first_block(h, blk) && !block_is_in_use(get_previous_block(blk))) {
+    table_remove(h, i--);
+    blk = coalesce(h, get_previous_block(blk));
+  }
+  ext->table_tags[i] = *((block_size_t *) blk);
+  pull_rovers(h, blk);
+}
+
+/*
+ * Return the address of the canary of an allocated block.
+ */
+static inline payload_align_t *get_canary(void *block_start)
+{
+  return get_payload(block_start) + get_payload_size(block_start) - CANARY_SIZE;
+}
+
+/*
+ * Write the canary of an allocated block.
+ */
+static inline void set_canary(heap *h, void *block_start)
+{
+  *get_canary(block_start) = CANARY_VALUE ^ (payload_align_t) (block_start - h->start);
+}
+
+/*
+ * Validate a pointer passed to heap_free on a hardened heap: it must be an
+ * aligned payload inside the heap, with a consistent in-use header/footer
+ * pair, an intact canary, and must not already be in quarantine.
+ */
+static heap_error_t check_free(heap *h, void *payload)
+{
+  heap_ext *ext = get_ext(h);
+  void *blk = get_block_start(payload);
+  block_size_t size;
+  int i;
+
+  if (!is_within_heap_range(h, blk))
+    return HEAP_ERR_RANGE;
+  if ((uintptr_t) payload % PAYLOAD_ALIGN != 0)
+    return HEAP_ERR_ALIGN;
+  size = get_block_size(blk);
+  if (size < 2 * HEADER_SIZE)
+    return HEAP_ERR_SIZE;
+  if (size > h->start + h->size - blk)
+    return HEAP_ERR_TOTAL;
+  if (*((block_size_t *) blk) != *((block_size_t *) (blk + size - HEADER_SIZE)))
+    return HEAP_ERR_FOOTER;
+  if (!block_is_in_use(blk))
+    return HEAP_ERR_DOUBLE_FREE;
+  for (i = 0; i < ext->quarantine_len; i++)
+    if (ext->quarantine[(ext->quarantine_head + i) % QUARANTINE_SLOTS] == blk)
+      return HEAP_ERR_DOUBLE_FREE;
+  if ((ext->flags & HEAP_HARDEN_CANARY)
+      && *get_canary(blk) != (CANARY_VALUE ^ (payload_align_t) (blk - h->start)))
+    return HEAP_ERR_CANARY;
+  return HEAP_OK;
+}
+
+/*
+ * Put a freed block in quarantine, releasing the oldest quarantined block
+ * if the quarantine is full.
+ */
+static void quarantine_block(heap *h, void *blk)
+{
+  heap_ext *ext = get_ext(h);
+  if (ext->quarantine_len == QUARANTINE_SLOTS) {
+    release_block(h, ext->quarantine[ext->quarantine_head]);
+    ext->quarantine_head = (ext->quarantine_head + 1) % QUARANTINE_SLOTS;
+    ext->quarantine_len--;
+  }
+  ext->quarantine[(ext->quarantine_head + ext->quarantine_len) % QUARANTINE_SLOTS] = blk;
+  ext->quarantine_len++;
+}
+
+/*
+ * Release every quarantined block.
+ */
+static void flush_quarantine(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  while (ext->quarantine_len > 0) {
+    release_block(h, ext->quarantine[ext->quarantine_head]);
+    ext->quarantine_head = (ext->quarantine_head + 1) % QUARANTINE_SLOTS;
+    ext->quarantine_len--;
+  }
+}
+
+/*
+ * Free a block on the heap h. On hardened heaps the pointer is validated
+ * first, and nothing is freed if it is rejected.
+ */
+static heap_error_t free_block(heap *h, void *payload)
+{
+  heap_ext *ext = get_ext(h);
+  void *blk;
+
+  if (payload == NULL)
+    return HEAP_OK;
+  blk = get_block_start(payload);
+  if (ext->flags == 0) {
+    if (ext->profile != NULL)
+      profile_free(ext->profile, payload);
+    release_block(h, blk);
+    return HEAP_OK;
+  }
+
+  if (ext->flags & HEAP_HARDEN_FREE) {
+    heap_error_t err = check_free(h, payload);
+    if (err != HEAP_OK)
+      return err;
+  }
+  if (ext->profile != NULL)
+    profile_free(ext->profile, payload);
+  if (ext->flags & HEAP_HARDEN_QUARANTINE)
+    quarantine_block(h, blk);
+  else
+    release_block(h, blk);
+  return HEAP_OK;
+}
+
+/*
+ * Queue a block freed by a thread that does not own the heap. The queue
+ * is a lock-free stack linked through the first word of the payloads, so
+ * any number of threads can push while the owner drains it.
+ */
+void heap_free_remote(heap *h, void *payload)
+{
+  heap_ext *ext = get_ext(h);
+  void *head = __atomic_load_n(&ext->remote_frees, __ATOMIC_RELAXED);
+
+  if (payload == NULL)
+    return;
+  do {
+    *((void **) payload) = head;
+  } while (!__atomic_compare_exchange_n(&ext->remote_frees, &head, payload, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Free every block queued by heap_free_remote. The whole queue is taken
+ * with a single exchange, so pushes racing with the drain are left for
+ * the next one.
+ */
+static void drain_remote_frees(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  void *payload, *next;
+
+  if (__atomic_load_n(&ext->remote_frees, __ATOMIC_RELAXED) == NULL)
+    return;
+  payload = __atomic_exchange_n(&ext->remote_frees, NULL, __ATOMIC_ACQUIRE);
+  for (; payload != NULL; payload = next) {
+    next = *((void **) payload);
+    free_block(h, payload);
+  }
+}
+
+/*
+ * Free the blocks queued by other threads now rather than at the next
+ * heap_malloc.
+ */
+void heap_drain_remote_frees(heap *h)
+{
+  if (lock_heap(h) != HEAP_OK)
+    return;
+  drain_remote_frees(h);
+  unlock_heap(h);
+}
+
+/*
+ * Background maintenance thread of a heap.
+ */
+typedef struct heap_worker {
+  pthread_t thread;
+  pthread_cond_t wake;              /* Signalled to stop the thread. */
+  int stop;                         /* Set when the thread must exit. */
+  uint32_t hint_gen;                /* hint_gen of the heap at the last pass. */
+  heap_maintenance opts;
+} heap_worker;
+
+/*
+ * Number of blocks a maintenance pass frees or trims per hold of the heap
+ * lock.
+ */
+#define MAINTENANCE_BATCH 16
+
+/*
+ * Pages of a free block that trim_free_blocks releases.
+ */
+typedef struct trim_range {
+  void *blk;                        /* The block, marked in use meanwhile. */
+  void *from;                       /* First whole page of its payload, */
+  void *to;                         /* and the end of the last one. */
+  int released;                     /* Set once madvise succeeded. */
+} trim_range;
+
+/*
+ * Return a block trimmed by trim_free_blocks to the free pool, clearing
+ * the partial pages around the released ones so that it is known to be
+ * zero. Return the start of the free block that now holds it.
+ */
+static void *untrim_block(heap *h, trim_range *r)
+{
+  heap_ext *ext = get_ext(h);
+  void *blk = r->blk, *start = blk, *next = get_next_block(blk);
+  int merged = is_within_heap_range(h, next) && !block_is_in_use(next);
+
+  if (!is_first_block(h, blk) && !block_is_in_use(get_previous_block(blk))) {
+    start = get_previous_block(blk);
+    merged = 1;
+  }
+  if (r->released) {
+    void *head = get_payload(blk) + sizeof(walk_hint);
+    memset(head, 0, r->from - head);
+    memset(r->to, 0, next - HEADER_SIZE - r->to);
+  }
+  release_block(h, blk);
+  if (r->released && !merged) {
+    mark_block_zero(blk);
+    if (ext->table_tags != NULL)
+      ext->table_tags[table_find(h, blk)] = *((block_size_t *) blk);
+  }
+  return start;
+}
+
+/*
+ * Release the memory of the pages inside free blocks of at least min_size
+ * bytes. The first bytes of the payload, which hold the walk hint, and the
+ * footer are kept, and the partial pages around the released ones are
+ * cleared so that the block is known to be zero. Only private heaps are
+ * trimmed: the pages of a file would just be read back.
+ *
+ * The blocks are taken MAINTENANCE_BATCH at a time. Each batch is marked in use,
+ * so that nothing allocates or merges them, and the heap lock is dropped
+ * around the madvise calls. Called with the lock held.
+ */
+static size_t trim_free_blocks(heap *h, size_t min_size)
+{
+  heap_ext *ext = get_ext(h);
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  trim_range ranges[MAINTENANCE_BATCH];
+  size_t trimmed = 0;
+  void *resume = h->start;
+  block_walk w;
+  void *blk;
+  int n, i;
+
+  if (ext->fd >= 0)
+    return 0;
+  while (resume != NULL) {
+    n = 0;
+    for (blk = walk_start(&w, h, resume, h->start + h->size, 1); blk && n < MAINTENANCE_BATCH;
+	 blk = walk_next(&w)) {
+      if (get_block_size(blk) < min_size || block_is_zero(blk))
+	continue;
+      void *head = get_payload(blk) + sizeof(walk_hint);
+      void *tail = get_next_block(blk) - HEADER_SIZE;
+      void *from = (void *) (((uintptr_t) head + page - 1) & -page);
+      void *to = (void *) ((uintptr_t) tail & -page);
+      if (to > from)
+	ranges[n++] = (trim_range) { blk, from, to, 0 };
+    }
+    if (n == 0)
+      break;
+    for (i = 0; i < n; i++) {
+      set_block_header(ranges[i].blk, get_block_size(ranges[i].blk), 1);
+      if (ext->table_tags != NULL)
+	ext->table_tags[table_find(h, ranges[i].blk)] = *((block_size_t *) ranges[i].blk);
+    }
+
+    /* Private heaps only, whose lock cannot fail */
+    ext->in_pass = 1;
+    unlock_heap(h);
+    for (i = 0; i < n; i++)
+      ranges[i].released = madvise(ranges[i].from, ranges[i].to - ranges[i].from,
+				   MADV_DONTNEED) == 0;
+    lock_heap(h);
+    ext->in_pass = 0;
+
+    for (i = 0; i < n; i++) {
+      if (ranges[i].released)
+	trimmed += ranges[i].to - ranges[i].from;
+      resume = untrim_block(h, &ranges[i]);
+    }
+    if (blk == NULL)
+      break;
+  }
+  return trimmed;
+}
+
+/*
+ * Free the blocks queued by heap_free_remote like drain_remote_frees, but
+ * let other threads take the heap lock between batches.
+ */
+static void drain_remote_frees_batched(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  void *payload, *next;
+  int n = 0;
+
+  if (__atomic_load_n(&ext->remote_frees, __ATOMIC_RELAXED) == NULL)
+    return;
+  payload = __atomic_exchange_n(&ext->remote_frees, NULL, __ATOMIC_ACQUIRE);
+  for (; payload != NULL; payload = next) {
+    if (++n % MAINTENANCE_BATCH == 0) {
+      ext->in_pass = 1;
+      unlock_heap(h);
+      sched_yield();
+      lock_heap(h);
+      ext->in_pass = 0;
+    }
+    next = *((void **) payload);
+    free_block(h, payload);
+  }
+}
+
+/*
+ * One pass of the maintenance thread: free the queued blocks, and when
+ * blocks were freed since the last pass, trim the large free blocks and
+ * walk the free blocks again to record fresh walk hints.
+ */
+static void maintain_heap(heap *h, heap_worker *w)
+{
+  heap_ext *ext = get_ext(h);
+  block_walk walk;
+  void *blk;
+
+  drain_remote_frees_batched(h);
+  if (ext->hint_gen == w->hint_gen)
+    return;
+  /* Trimming frees the blocks again, so the hints are recorded after it */
+  if (w->opts.trim_threshold > 0)
+    trim_free_blocks(h, w->opts.trim_threshold);
+  for (blk = walk_start(&walk, h, h->start, h->start + h->size, 1); blk; blk = walk_next(&walk))
+    ;
+  w->hint_gen = ext->hint_gen;
+}
+
+/*
+ * Body of the maintenance thread. It holds the heap lock during passes,
+ * apart from short breaks between batches of blocks, and releases it
+ * while it waits for the next one.
+ */
+static void *maintenance_main(void *arg)
+{
+  heap *h = arg;
+  heap_ext *ext = get_ext(h);
+  heap_worker *w = ext->worker;
+  struct timespec deadline;
+
+  pthread_mutex_lock(ext->lock);
+  while (!w->stop) {
+    maintain_heap(h, w);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += w->opts.interval_ms / 1000;
+    deadline.tv_nsec += (long) (w->opts.interval_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while (!w->stop && pthread_cond_timedwait(&w->wake, ext->lock, &deadline) == 0)
+      ;
+  }
+  pthread_mutex_unlock(ext->lock);
+  return NULL;
+}
+
+/*
+ * Start the maintenance thread of a heap.
+ */
+int heap_start_maintenance(heap *h, const heap_maintenance *opts)
+{
+  heap_ext *ext = get_ext(h);
+  pthread_condattr_t attr;
+  heap_worker *w;
+  int err;
+
+  if (ext->shared != NULL || ext->worker != NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (heap_set_thread_safe(h) < 0)
+    return -1;
+  w = malloc(sizeof(heap_worker));
+  if (w == NULL)
+    return -1;
+  w->stop = 0;
+  w->hint_gen = 0;
+  w->opts = *opts;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  err = pthread_cond_init(&w->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  if (err != 0) {
+    free(w);
+    errno = err;
+    return -1;
+  }
+
+  __atomic_store_n(&ext->worker, w, __ATOMIC_RELEASE);
+  err = pthread_create(&w->thread, NULL, maintenance_main, h);
+  if (err != 0) {
+    __atomic_store_n(&ext->worker, NULL, __ATOMIC_RELEASE);
+    pthread_cond_destroy(&w->wake);
+    free(w);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Stop the maintenance thread of a heap, and free what it left queued.
+ */
+void heap_stop_maintenance(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  heap_worker *w = ext->worker;
+
+  if (w == NULL)
+    return;
+  pthread_mutex_lock(ext->lock);
+  w->stop = 1;
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(ext->lock);
+  pthread_join(w->thread, NULL);
+  __atomic_store_n(&ext->worker, NULL, __ATOMIC_RELEASE);
+  pthread_cond_destroy(&w->wake);
+  free(w);
+  heap_drain_remote_frees(h);
+}
+
+/*
+ * Give the memory of large free blocks back to the system.
+ */
+size_t heap_trim(heap *h, size_t min_size)
+{
+  size_t trimmed;
+  if (lock_heap(h) != HEAP_OK)
+    return 0;
+  drain_remote_frees(h);
+  trimmed = trim_free_blocks(h, min_size);
+  unlock_heap(h);
+  return trimmed;
+}
+
+/*
+ * Free a block on the heap h. Heaps with a maintenance thread only queue
+ * the block for it.
+ */
+heap_error_t heap_free(heap *h, void *payload)
+{
+  heap_ext *ext = get_ext(h);
+  heap_error_t err;
+  if (payload == NULL)
+    return HEAP_OK;
+  if (__atomic_load_n(&ext->worker, __ATOMIC_ACQUIRE) != NULL
+      && !(ext->flags & HEAP_HARDEN_FREE)) {
+    heap_free_remote(h, payload);
+    return HEAP_OK;
+  }
+  err = lock_heap(h);
+  if (err != HEAP_OK)
+    return err;
+  err = free_block(h, payload);
+  unlock_heap(h);
+  return err;
+}
+
+/*
+ * Check that a block may have been allocated for "size" bytes: it must
+ * hold them, and have no more room to spare than the split policy leaves
+ * in a block it does not split, under the largest split threshold the
+ * heap has used. Blocks of a persistent or shared heap may come from
+ * another session or process with its own tuning, so those heaps allow
+ * any threshold the adaptive policy can reach.
+ */
+static heap_error_t check_free_size(heap *h, void *payload, block_size_t size)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t threshold = ext->split_threshold_max;
+  block_size_t real_size = get_size_to_allocate(size);
+  block_size_t unused;
+
+  if (ext->fd >= 0 && threshold < SPLIT_THRESHOLD_MAX)
+    threshold = SPLIT_THRESHOLD_MAX;
+  if (real_size == 0 || real_size > get_block_size(get_block_start(payload)))
+    return HEAP_ERR_FREE_SIZE;
+  unused = get_block_size(get_block_start(payload)) - real_size;
+  if (unused >= 2 * HEADER_SIZE && (unused > real_size || unused >= threshold))
+    return HEAP_ERR_FREE_SIZE;
+  return HEAP_OK;
+}
+
+/*
+ * Free a block allocated for "size" bytes. The header of the next block,
+ * which coalescing reads once the block size is known, is prefetched from
+ * the size beforehand. The size cannot replace the header: blocks the
+ * split policy handed out whole are larger than the size says.
+ */
+heap_error_t heap_free_sized(heap *h, void *payload, block_size_t size)
+{
+  heap_ext *ext = get_ext(h);
+  heap_error_t err;
+
+  if (payload == NULL)
+    return HEAP_OK;
+  if (ext->flags & HEAP_HARDEN_CANARY)
+    size = size > MAX_USER_SIZE - CANARY_SIZE ? MAX_USER_SIZE + 1 : size + CANARY_SIZE;
+  __builtin_prefetch(get_block_start(payload) + get_size_to_allocate(size), 1);
+  if (!(ext->flags & HEAP_HARDEN_FREE))
+    return heap_free(h, payload);
+
+  err = lock_heap(h);
+  if (err != HEAP_OK)
+    return err;
+  err = check_free(h, payload);
+  if (err == HEAP_OK)
+    err = check_free_size(h, payload, size);
+  if (err == HEAP_OK)
+    err = free_block(h, payload);
+  unlock_heap(h);
+  return err;
+}
+
+/*
+ * Read the split policy of a heap.
+ */
+void heap_get_tuning(heap *h, heap_tuning *tuning)
+{
+  if (lock_heap(h) != HEAP_OK)
+    return;
+  *tuning = get_ext(h)->tuning;
+  unlock_heap(h);
+}
+
+/*
+ * Change the split policy of a heap, starting a new review window for the
+ * adaptive policy.
+ */
+int heap_set_tuning(heap *h, const heap_tuning *tuning)
+{
+  heap_ext *ext = get_ext(h);
+  if (tuning->split_threshold < 2 * HEADER_SIZE || tuning->waste_percent > 100) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (lock_heap(h) != HEAP_OK)
+    return -1;
+  ext->tuning = *tuning;
+  ext->split_window = ext->split_stats;
+  if (ext->split_threshold_max < tuning->split_threshold)
+    ext->split_threshold_max = tuning->split_threshold;
+  unlock_heap(h);
+  return 0;
+}
+
+/*
+ * Read the split policy counters of a heap.
+ */
+void heap_get_split_stats(heap *h, heap_split_stats *stats)
+{
+  if (lock_heap(h) != HEAP_OK)
+    return;
+  *stats = get_ext(h)->split_stats;
+  unlock_heap(h);
+}
+
+/*
+ * Select the hardening options of the heap. Blocks allocated before
+ * canaries are turned on must not be freed after.
+ */
+void heap_set_hardening(heap *h, int flags)
+{
+  heap_ext *ext = get_ext(h);
+  if (lock_heap(h) != HEAP_OK)
+    return;
+  if (ext->shared != NULL) {
+    /* A quarantine is private to a process, and would let a block be
+       freed again by another process while quarantined */
+    flags &= ~HEAP_HARDEN_QUARANTINE;
+    ext->shared->flags = flags & HEAP_HARDEN_ALL;
+  }
+  if (!(flags & HEAP_HARDEN_QUARANTINE))
+    flush_quarantine(h);
+  ext->flags = flags & HEAP_HARDEN_ALL;
+  unlock_heap(h);
+}
+
+/*
+ * Header at the start of the file of a persistent heap. It holds offsets
+ * only, so the file can be mapped at a different address each time.
+ */
+#define HEAP_FILE_MAGIC 0x70616568 /* "heap" */
+#define HEAP_FILE_VERSION 1
+
+typedef struct heap_file_header {
+  uint32_t magic;                   /* HEAP_FILE_MAGIC. */
+  uint32_t version;                 /* HEAP_FILE_VERSION. */
+  uint32_t tag_bits;                /* HEAP_TAG_BITS of the writer. */
+  uint32_t flags;                   /* HEAP_HARDEN_* options. */
+  uint64_t start;                   /* Offset of the first block in the file. */
+  uint64_t size;                    /* Size of the block area in bytes. */
+  uint64_t next;                    /* Offset of h->next from the first block. */
+  uint64_t dirty;                   /* Nonzero while the heap is open. */
+} heap_file_header;
+
+/*
+ * Offset of the first block in the file.
+ */
+#define HEAP_FILE_START REGION_START(heap_file_header)
+
+/*
+ * Determine whether the header of a persistent heap file of file_size
+ * bytes was written by a compatible heap and describes a block area that
+ * fits in the file.
+ */
+static int file_header_is_valid(heap_file_header *hdr, uint64_t file_size)
+{
+  return hdr->magic == HEAP_FILE_MAGIC
+    && hdr->version == HEAP_FILE_VERSION
+    && hdr->tag_bits == HEAP_TAG_BITS
+    && hdr->start == HEAP_FILE_START
+    && hdr->size >= 2 * PAYLOAD_ALIGN
+    && hdr->size % PAYLOAD_ALIGN == 0
+    && hdr->size <= MAX_BLOCK_SIZE
+    && hdr->start <= file_size
+    && hdr->size <= file_size - hdr->start
+    && hdr->next < hdr->size
+    && hdr->next % PAYLOAD_ALIGN == 0
+    && (hdr->flags & ~HEAP_HARDEN_ALL) == 0;
+}
+
+/*
+ * Open the persistent heap stored in the file at path, creating a heap of
+ * "size" bytes if the file is empty or missing. The file is locked, so
+ * that a single process at a time can use it. The blocks are used in
+ * place; only a heap that was not closed cleanly is walked and validated.
+ */
+heap *heap_open(const char *path, intptr_t size, search_alg_t search_alg)
+{
+  heap_file_header *hdr;
+  heap_ext *ext;
+  heap *h;
+  void *region;
+  struct stat st;
+  int fd, err;
+
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return NULL;
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0)
+    goto fail_fd;
+
+  if (st.st_size == 0) {
+    if (size < (intptr_t) (HEAP_FILE_START + 2 * PAYLOAD_ALIGN)
+	|| size - HEAP_FILE_START > MAX_BLOCK_SIZE) {
+      errno = EINVAL;
+      goto fail_fd;
+    }
+    if (ftruncate(fd, size) < 0)
+      goto fail_fd;
+  }
+  else if (st.st_size < (off_t) sizeof(heap_file_header)) {
+    errno = EINVAL;
+    goto fail_fd;
+  }
+  else {
+    size = st.st_size;
+  }
+
+  region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (region == MAP_FAILED)
+    goto fail_fd;
+  hdr = region;
+  if (st.st_size == 0) {
+    hdr->magic = HEAP_FILE_MAGIC;
+    hdr->version = HEAP_FILE_VERSION;
+    hdr->tag_bits = HEAP_TAG_BITS;
+    hdr->start = HEAP_FILE_START;
+    hdr->size = (size - HEAP_FILE_START) & -PAYLOAD_ALIGN;
+    hdr->next = 0;
+    hdr->dirty = 0;
+#ifdef HEAP_HARDENED
+    hdr->flags = HEAP_HARDEN_ALL;
+#else
+    hdr->flags = 0;
+#endif
+    set_block_header(region + hdr->start, hdr->size, 0);
+    mark_block_zero(region + hdr->start);
+  }
+  else if (!file_header_is_valid(hdr, size)) {
+    errno = EINVAL;
+    goto fail_map;
+  }
+
+  /* The control state lives in process memory, below struct heap as usual */
+  ext = malloc(sizeof(heap_ext) + sizeof(heap));
+  if (ext == NULL)
+    goto fail_map;
+  h = (heap *) (ext + 1);
+  init_ext(ext);
+  ext->flags = hdr->flags;
+  ext->region = region;
+  ext->region_len = size;
+  ext->fd = fd;
+  h->search_alg = search_alg;
+  h->size = hdr->size;
+  h->start = region + hdr->start;
+  h->next = h->start + hdr->next;
+
+  if (hdr->dirty) {
+    /* The last user did not close the heap; blocks may be half updated */
+    h->next = h->start;
+    if (check_blocks(h, HEAP_CHECK_FAST) != HEAP_OK) {
+      free(ext);
+      errno = EINVAL;
+      goto fail_map;
+    }
+  }
+  reset_rovers(h);
+  hdr->dirty = 1;
+  return h;
+
+ fail_map:
+  err = errno;
+  munmap(region, size);
+  errno = err;
+ fail_fd:
+  err = errno;
+  close(fd);
+  errno = err;
+  return NULL;
+}
+
+/*
+ * Record the state kept outside the blocks in the file header of a
+ * persistent heap, and flush the whole heap to the file. Blocks in the
+ * hardened quarantine stay allocated in the file until heap_close.
+ */
+int heap_sync(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  heap_file_header *hdr = ext->region;
+
+  if (hdr == NULL || ext->fd < 0 || ext->shared != NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  hdr->next = h->next - h->start;
+  hdr->flags = ext->flags;
+  return msync(ext->region, ext->region_len, MS_SYNC);
+}
+
+/*
+ * Close a persistent heap opened with heap_open, or detach from a shared
+ * heap. Pointers into the heap are invalid afterwards; save them as
+ * offsets from h->start instead.
+ */
+int heap_close(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  heap_file_header *hdr = ext->region;
+  int ret = 0;
+
+  if (hdr == NULL || ext->fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  heap_stop_maintenance(h);
+  heap_drain_remote_frees(h);
+  if (ext->shared == NULL) {
+    flush_quarantine(h);
+    heap_disable_side_table(h);
+    hdr->dirty = 0;
+    ret = heap_sync(h);
+  }
+  profile_release(ext);
+  munmap(ext->region, ext->region_len);
+  close(ext->fd);
+  free(ext);
+  return ret;
+}
+
+/*
+ * Make a process-local handle for the shared heap mapped at region, with
+ * its own duplicate of fd.
+ */
+static heap *attach_region(void *region, size_t region_len, int fd,
+			   search_alg_t search_alg)
+{
+  heap_shared_header *sh = region;
+  heap_ext *ext = malloc(sizeof(heap_ext) + sizeof(heap));
+  heap *h;
+
+  if (ext == NULL)
+    return NULL;
+  init_ext(ext);
+  ext->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (ext->fd < 0) {
+    free(ext);
+    return NULL;
+  }
+  ext->region = region;
+  ext->region_len = region_len;
+  ext->shared = sh;
+  ext->lock = &sh->lock;
+  ext->flags = sh->flags;
+  h = (heap *) (ext + 1);
+  h->search_alg = search_alg;
+  h->size = sh->size;
+  h->start = region + sh->start;
+  h->next = h->start + sh->next;
+  reset_rovers(h);
+  return h;
+}
+
+/*
+ * Create a heap that is "size" bytes large in an anonymous shared memory
+ * file, which other processes can map with heap_attach_shared.
+ */
+heap *heap_create_shared(intptr_t size, search_alg_t search_alg)
+{
+  pthread_mutexattr_t attr;
+  heap_shared_header *sh;
+  heap *h = NULL;
+  int fd, err;
+
+  if (size < (intptr_t) (REGION_START(heap_shared_header) + 2 * PAYLOAD_ALIGN)
+      || size - REGION_START(heap_shared_header) > MAX_BLOCK_SIZE) {
+    errno = EINVAL;
+    return NULL;
+  }
+  fd = memfd_create("implicit-heap", MFD_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  if (ftruncate(fd, size) < 0)
+    goto out;
+  sh = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (sh == MAP_FAILED)
+    goto out;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  err = pthread_mutex_init(&sh->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (err != 0) {
+    munmap(sh, size);
+    errno = err;
+    goto out;
+  }
+  sh->magic = HEAP_SHARED_MAGIC;
+  sh->tag_bits = HEAP_TAG_BITS;
+  sh->start = REGION_START(heap_shared_header);
+  sh->size = (size - sh->start) & -PAYLOAD_ALIGN;
+  sh->next = 0;
+  sh->error = HEAP_OK;
+#ifdef HEAP_HARDENED
+  sh->flags = HEAP_HARDEN_ALL & ~HEAP_HARDEN_QUARANTINE;
+#else
+  sh->flags = 0;
+#endif
+  set_block_header((void *) sh + sh->start, sh->size, 0);
+  mark_block_zero((void *) sh + sh->start);
+
+  h = attach_region(sh, size, fd, search_alg);
+  if (h == NULL)
+    munmap(sh, size);
+ out:
+  err = errno;
+  close(fd);
+  errno = err;
+  return h;
+}
+
+/*
+ * Map the shared heap behind fd, a descriptor obtained from
+ * heap_shared_fd in another process.
+ */
+heap *heap_attach_shared(int fd, search_alg_t search_alg)
+{
+  heap_shared_header *sh;
+  struct stat st;
+  heap *h;
+
+  if (fstat(fd, &st) < 0)
+    return NULL;
+  if (st.st_size < (off_t) sizeof(heap_shared_header)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  sh = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (sh == MAP_FAILED)
+    return NULL;
+  if (sh->magic != HEAP_SHARED_MAGIC
+      || sh->tag_bits != HEAP_TAG_BITS
+      || sh->start != REGION_START(heap_shared_header)
+      || sh->size > (uint64_t) st.st_size - sh->start) {
+    munmap(sh, st.st_size);
+    errno = EINVAL;
+    return NULL;
+  }
+  h = attach_region(sh, st.st_size, fd, search_alg);
+  if (h == NULL)
+    munmap(sh, st.st_size);
+  return h;
+}
+
+/*
+ * Return the descriptor of the memory behind a shared heap, or -1 if the
+ * heap is not shared. It stays owned by the heap.
+ */
+int heap_shared_fd(heap *h)
+{
+  heap_ext *ext = get_ext(h);
+  return ext->shared != NULL ? ext->fd : -1;
+}
+
+/*
+ * Return the offset of an address in the heap from h->start.
+ */
+intptr_t heap_offset(heap *h, void *addr)
+{
+  return addr - h->start;
+}
+
+/*
+ * Return the address at offset from h->start, or NULL if it lies outside
+ * the heap.
+ */
+void *heap_pointer(heap *h, intptr_t offset)
+{
+  if (offset < 0 || offset >= h->size)
+    return NULL;
+  return h->start + offset;
+}
+
+/*
+ * Malloc a block on the heap h, using first fit. Return NULL if no block
+ * large enough to satisfy the request exits.
+ */
+static void *malloc_first_fit(heap *h, block_size_t user_size)
+{
+  /* TO BE COMPLETED BY THE STUDENT. */
+  block_size_t real_size = get_size_to_allocate(user_size);
+  if(real_size <= 2*HEADER_SIZE){ // empty or oversized request
+    return NULL;
+  }
+  
+  block_walk w;
+  void* blk;
+  void* payload;
+  for(blk = walk_start(&w, h, h->start, h->start + h->size, 1); blk; blk = walk_next(&w)){
+    if(get_block_size(blk) >= real_size){
+      blk = claim_block(h, blk, real_size);
+      payload = get_payload(blk);
+      return payload;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Malloc a block on the heap h, using best fit. Return NULL if no block
+ * large enough to satisfy the request exits.
+ */
+static void *malloc_best_fit(heap *h, block_size_t user_size)
+{
+  /* TO BE COMPLETED BY THE STUDENT. */
+  block_size_t real_size = get_size_to_allocate(user_size);
+  if(real_size <= 2*HEADER_SIZE){ // empty or oversized request
+    return NULL;
+  }
+
+  block_walk w;
+  void* blk;
+  void* best_blk = NULL;
+  block_size_t blk_size;
+  block_size_t best_diff = 0;
+  for(blk = walk_start(&w, h, h->start, h->start + h->size, 1); blk; blk = walk_next(&w)){
+    blk_size = get_block_size(blk);
+    if(blk_size >= real_size
+       && (best_blk == NULL || blk_size - real_size <= best_diff)){
+      best_diff = blk_size - real_size;
+      best_blk = blk;
+    }
+  }
+
+  if(best_blk != NULL){
+    best_blk = claim_block(h, best_blk, real_size);
+    return get_payload(best_blk);
+  }
+  else{
+    return NULL;
+  }
+}
+
+/*
+ * Malloc a block on the heap h, using next fit. Return NULL if no block
+ * large enough to satisfy the request exits. HEAP_SEGNEXTFIT heaps keep
+ * one rover per size class, so large requests do not carry small ones
+ * away from the holes they were filling.
+ */
+static void *malloc_next_fit(heap *h, block_size_t user_size)
+{
+  /* TO BE COMPLETED BY THE STUDENT. */
+  block_size_t real_size = get_size_to_allocate(user_size);
+  if(real_size <= 2*HEADER_SIZE){ // empty or oversized request
+    return NULL;
+  }
+
+  void** rover = get_rover(h, real_size);
+  block_walk w;
+  void* blk;
+  void* payload;
+  for(blk = walk_start(&w, h, *rover, h->start + h->size, 1); blk; blk = walk_next(&w)){
+    if(get_block_size(blk)>=real_size){
+      blk = claim_block(h, blk, real_size);
+      payload = get_payload(blk);
+      *rover = blk;
+      return payload;
+    }
+  }
+
+  for(blk = walk_start(&w, h, h->start, *rover, 1); blk; blk = walk_next(&w)){
+    if(get_block_size(blk)>=real_size){
+      blk = claim_block(h, blk, real_size);
+      payload = get_payload(blk);
+      *rover = blk;
+      return payload;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Hand out the top real_size bytes of a free block, leaving the rest of
+ * it free below, and count it like claim_block. The whole block is handed
+ * out when the split policy would not split it.
+ */
+static void *claim_block_high(heap *h, void *blk, block_size_t real_size)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t unused = get_block_size(blk) - real_size;
+  void *high;
+  int zero;
+
+  if (unused < 2 * HEADER_SIZE
+      || (unused <= real_size && unused < ext->tuning.split_threshold))
+    return claim_block(h, blk, real_size);
+  zero = block_is_zero(blk);
+  set_block_header(blk, unused, 0);
+  high = blk + unused;
+  set_block_header(high, real_size, 1);
+  if (zero) {
+    mark_block_zero(blk);
+    mark_block_zero(high);
+  }
+  if (ext->table_tags != NULL) {
+    size_t i = table_find(h, blk);
+    ext->table_tags[i] = *((block_size_t *) blk);
+    table_insert(h, i + 1, high);
+  }
+  ext->split_stats.allocs++;
+  ext->split_stats.bytes += real_size;
+  ext->split_stats.splits++;
+  if (ext->tuning.adaptive
+      && ext->split_stats.allocs - ext->split_window.allocs >= HEAP_SPLIT_ADAPT_INTERVAL)
+    adapt_split_threshold(h);
+  return high;
+}
+
+/*
+ * Malloc a block on the heap h from the highest free block that fits,
+ * walking down from the end of the heap through the footers, or through
+ * the side table when there is one.
+ */
+static void *malloc_top_fit(heap *h, block_size_t user_size)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t real_size = get_size_to_allocate(user_size);
+  void *blk;
+  size_t i;
+
+  if (real_size <= 2 * HEADER_SIZE) // empty or oversized request
+    return NULL;
+
+  if (ext->table_tags != NULL) {
+    for (i = ext->table_len; i-- > 0; ) {
+      block_size_t tag = ext->table_tags[i];
+      if (!(tag & 1) && tag >= real_size)
+	return get_payload(claim_block_high(h, h->start + ext->table_offsets[i], real_size));
+    }
+    return NULL;
+  }
+
+  for (blk = h->start + h->size; blk > h->start; ) {
+    blk = get_previous_block(blk);
+    if (!block_is_in_use(blk) && get_block_size(blk) >= real_size)
+      return get_payload(claim_block_high(h, blk, real_size));
   }
   return NULL;
 }
 
+/*
+ * Return the wilderness, the free block at the end of the heap, or NULL
+ * if the last block is in use. It is found through the footer of the last
+ * block, so it needs no tracking: it shrinks as it is split and grows
+ * back as the blocks before it are freed and coalesced into it.
+ */
+static inline void *get_wilderness(heap *h)
+{
+  void *end = h->start + h->size;
+  void *last = end - get_block_size(end - HEADER_SIZE);
+  return block_is_in_use(last) ? NULL : last;
+}
+
+/*
+ * Malloc a block on the heap h from the wilderness when none of the first
+ * wilderness_probe blocks where the search of the heap starts can hold
+ * it. Return NULL if the normal search should run instead: a nearby block
+ * fits, the probe reached the end of the heap, or the wilderness is too
+ * small.
+ */
+static void *malloc_wilderness(heap *h, block_size_t user_size)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t real_size = get_size_to_allocate(user_size);
+  void *end = h->start + h->size;
+  void **rover = get_rover(h, real_size);
+  void *blk, *wild;
+  unsigned n;
+
+  if (ext->tuning.wilderness_probe == 0 || real_size <= 2 * HEADER_SIZE)
+    return NULL;
+  blk = h->search_alg == HEAP_NEXTFIT || h->search_alg == HEAP_SEGNEXTFIT
+    ? *rover : h->start;
+  for (n = 0; n < ext->tuning.wilderness_probe; n++) {
+    if (blk >= end)
+      return NULL;
+    if (!block_is_in_use(blk) && get_block_size(blk) >= real_size)
+      return NULL;
+    blk = get_next_block(blk);
+  }
+  wild = get_wilderness(h);
+  if (wild == NULL || wild < blk || get_block_size(wild) < real_size)
+    return NULL;
+  wild = claim_block(h, wild, real_size);
+  if (h->search_alg == HEAP_NEXTFIT || h->search_alg == HEAP_SEGNEXTFIT)
+    *rover = wild;
+  return get_payload(wild);
+}
+
+/*
+ * Malloc a block on the heap h, placing it for the expected lifetime
+ * given by hint.
+ */
+static void *malloc_block_hint(heap *h, block_size_t size, int hint)
+{
+  heap_ext *ext = get_ext(h);
+  void *payload = NULL;
+
+  if (ext->flags & HEAP_HARDEN_CANARY) {
+    if (size == 0 || size > MAX_USER_SIZE - CANARY_SIZE)
+      return NULL;
+    size += CANARY_SIZE;
+  }
+
+  if (hint == HEAP_HINT_LONG)
+    payload = malloc_top_fit(h, size);
+  else if (ext->table_tags != NULL)
+    payload = malloc_side_table(h, size);
+  else if ((payload = malloc_wilderness(h, size)) != NULL)
+    ;
+  else switch (h->search_alg) {
+  case HEAP_FIRSTFIT:
+    payload = malloc_first_fit(h, size);
+    break;
+  case HEAP_NEXTFIT:
+  case HEAP_SEGNEXTFIT:
+    payload = malloc_next_fit(h, size);
+    break;
+  case HEAP_BESTFIT:
+    payload = malloc_best_fit(h, size);
+    break;
+  }
+
+  if (payload != NULL && (ext->flags & HEAP_HARDEN_CANARY))
+    set_canary(h, get_block_start(payload));
+  return payload;
+}
+
+/*
+ * Malloc a block on the heap h with the search policy of the heap.
+ */
+static void *malloc_block(heap *h, block_size_t size)
+{
+  return malloc_block_hint(h, size, HEAP_HINT_NONE);
+}
+
+/*
+ * Malloc a block after freeing the queued blocks. On heaps with a
+ * maintenance thread the queue is left to the thread, unless the heap
+ * is out of memory without the queued blocks or the blocks held by a
+ * trim in progress.
+ */
+static void *malloc_drained(heap *h, block_size_t size, int hint)
+{
+  heap_ext *ext = get_ext(h);
+  void *payload;
+
+  if (ext->worker == NULL)
+    drain_remote_frees(h);
+  payload = malloc_block_hint(h, size, hint);
+  if (payload == NULL && ext->worker != NULL
+      && __atomic_load_n(&ext->remote_frees, __ATOMIC_RELAXED) != NULL) {
+    drain_remote_frees(h);
+    payload = malloc_block_hint(h, size, hint);
+  }
+  if (payload == NULL && ext->in_pass) {
+    /* The blocks being trimmed may be enough once they are given back */
+    wait_for_pass(h);
+    payload = malloc_block_hint(h, size, hint);
+  }
+  return payload;
+}
+
+/*
+ * Our implementation of malloc.
+ */
+void *heap_malloc(heap *h, block_size_t size)
+{
+  heap_ext *ext = get_ext(h);
+  void *payload;
+  if (lock_heap(h) != HEAP_OK)
+    return NULL;
+  payload = malloc_drained(h, size, HEAP_HINT_NONE);
+  if (ext->profile != NULL && payload != NULL)
+    profile_malloc(ext->profile, payload, size, __builtin_return_address(0));
+  unlock_heap(h);
+  return payload;
+}
+
+/*
+ * Malloc a block placed for the expected lifetime given by hint.
+ */
+void *heap_malloc_hint(heap *h, block_size_t size, int hint)
+{
+  heap_ext *ext = get_ext(h);
+  void *payload;
+  if (lock_heap(h) != HEAP_OK)
+    return NULL;
+  payload = malloc_drained(h, size, hint);
+  if (ext->profile != NULL && payload != NULL)
+    profile_malloc(ext->profile, payload, size, __builtin_return_address(0));
+  unlock_heap(h);
+  return payload;
+}
+
+/*
+ * Our implementation of calloc. Only the bytes that may hold a walk hint
+ * are cleared in blocks known to be zero.
+ */
+void *heap_calloc(heap *h, size_t nmemb, size_t size)
+{
+  heap_ext *ext = get_ext(h);
+  size_t total;
+  void *payload;
+  int zero;
+
+  if (__builtin_mul_overflow(nmemb, size, &total) || total > MAX_USER_SIZE)
+    return NULL;
+  if (lock_heap(h) != HEAP_OK)
+    return NULL;
+  payload = malloc_drained(h, total, HEAP_HINT_NONE);
+  if (payload == NULL) {
+    unlock_heap(h);
+    return NULL;
+  }
+  zero = block_is_zero(get_block_start(payload));
+  if (ext->profile != NULL)
+    profile_malloc(ext->profile, payload, total, __builtin_return_address(0));
+  unlock_heap(h);
+
+  /* The block is ours now, so it is cleared without the lock */
+  if (zero && total > sizeof(walk_hint))
+    total = sizeof(walk_hint);
+  memset(payload, 0, total);
+  return payload;
+}
+
+/*
+ * Return the number of bytes the user can store in an allocated block.
+ */
+size_t heap_usable_size(heap *h, void *payload)
+{
+  size_t size = get_payload_size(get_block_start(payload));
+  if (get_ext(h)->flags & HEAP_HARDEN_CANARY)
+    size -= CANARY_SIZE;
+  return size;
+}
+
+/*
+ * Shrink the allocated block blk to real_size bytes if the unused part is
+ * worth splitting off by the same rule as prepare_block_for_use, and free
+ * that part.
+ */
+static void split_block(heap *h, void *blk, block_size_t real_size)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t unused = get_block_size(blk) - real_size;
+  void *rest;
+
+  if (unused < 2 * HEADER_SIZE
+      || (unused <= real_size && unused < ext->tuning.split_threshold))
+    return;
+  set_block_header(blk, real_size, 1);
+  rest = get_next_block(blk);
+  set_block_header(rest, unused, 1);
+  if (ext->table_tags != NULL) {
+    size_t i = table_find(h, blk);
+    ext->table_tags[i] = *((block_size_t *) blk);
+    table_insert(h, i + 1, rest);
+  }
+  release_block(h, rest);
+}
+
+/*
+ * Resize an allocated block, in place when the block or its free
+ * successor is large enough, and by moving it otherwise.
+ */
+static void *realloc_block(heap *h, void *payload, block_size_t size)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t real_size, user_size = size;
+  void *blk, *next, *new_payload;
+  size_t old_size;
+
+  if (payload == NULL)
+    return malloc_block(h, size);
+  if (size == 0) {
+    free_block(h, payload);
+    return NULL;
+  }
+  if ((ext->flags & HEAP_HARDEN_FREE) && check_free(h, payload) != HEAP_OK)
+    return NULL;
+  if (ext->flags & HEAP_HARDEN_CANARY) {
+    if (size > MAX_USER_SIZE - CANARY_SIZE)
+      return NULL;
+    size += CANARY_SIZE;
+  }
+  real_size = get_size_to_allocate(size);
+  if (real_size == 0)
+    return NULL;
+
+  blk = get_block_start(payload);
+  if (get_block_size(blk) < real_size) {
+    /* Try to grow into the next block */
+    next = get_next_block(blk);
+    if (is_within_heap_range(h, next) && !block_is_in_use(next)
+	&& get_block_size(blk) + get_block_size(next) >= real_size) {
+      if (ext->table_tags != NULL)
+	table_remove(h, table_find(h, next));
+      move_rovers(h, next, blk);
+      invalidate_hints(h);
+      set_block_header(blk, get_block_size(blk) + get_block_size(next), 1);
+      if (ext->table_tags != NULL)
+	ext->table_tags[table_find(h, blk)] = *((block_size_t *) blk);
+    }
+  }
+
+  if (get_block_size(blk) >= real_size) {
+    split_block(h, blk, real_size);
+    if (ext->flags & HEAP_HARDEN_CANARY)
+      set_canary(h, blk);
+    return payload;
+  }
+
+  new_payload = malloc_block(h, user_size);
+  if (new_payload == NULL)
+    return NULL;
+  old_size = heap_usable_size(h, payload);
+  memcpy(new_payload, payload, old_size < user_size ? old_size : user_size);
+  /* Carry a sample over before free_block records it as freed */
+  if (ext->profile != NULL)
+    profile_move(ext->profile, payload, new_payload);
+  free_block(h, payload);
+  return new_payload;
+}
+
+/*
+ * Resize a block allocated by heap_malloc.
+ */
+void *heap_realloc(heap *h, void *payload, block_size_t size)
+{
+  void *new_payload;
+  if (lock_heap(h) != HEAP_OK)
+    return NULL;
+  new_payload = realloc_block(h, payload, size);
+  unlock_heap(h);
+  return new_payload;
+}
+
+/*
+ * Malloc a block whose payload is aligned to alignment bytes, a power of
+ * two. A larger block is allocated, and the part in front of the aligned
+ * payload is split off and freed.
+ */
+static void *malloc_aligned_block(heap *h, size_t alignment, block_size_t size)
+{
+  heap_ext *ext = get_ext(h);
+  block_size_t min_block = (2 * HEADER_SIZE + PAYLOAD_ALIGN - 1) & -PAYLOAD_ALIGN;
+  void *payload, *blk, *aligned_blk;
+  block_size_t gap;
+
+  if (alignment <= PAYLOAD_ALIGN)
+    return malloc_block(h, size);
+  if ((alignment & (alignment - 1)) != 0 || size == 0 || alignment > MAX_USER_SIZE / 2
+      || size > MAX_USER_SIZE - alignment - min_block - CANARY_SIZE)
+    return NULL;
+
+  payload = malloc_block(h, size + alignment + min_block);
+  if (ext->flags & HEAP_HARDEN_CANARY)
+    size += CANARY_SIZE;
+  if (payload == NULL)
+    return NULL;
+  if ((uintptr_t) payload % alignment == 0) {
+    split_block(h, get_block_start(payload), get_size_to_allocate(size));
+    if (ext->flags & HEAP_HARDEN_CANARY)
+      set_canary(h, get_block_start(payload));
+    return payload;
+  }
+
+  /* Leave room for a free block in front of the aligned payload */
+  blk = get_block_start(payload);
+  aligned_blk = get_block_start((void *) (((uintptr_t) payload + min_block + alignment - 1)
+					  & -(uintptr_t) alignment));
+  gap = aligned_blk - blk;
+  set_block_header(aligned_blk, get_block_size(blk) - gap, 1);
+  set_block_header(blk, gap, 1);
+  if (ext->table_tags != NULL) {
+    size_t i = table_find(h, blk);
+    ext->table_tags[i] = *((block_size_t *) blk);
+    table_insert(h, i + 1, aligned_blk);
+  }
+  move_rovers(h, blk, aligned_blk);
+  release_block(h, blk);
+
+  split_block(h, aligned_blk, get_size_to_allocate(size));
+  if (ext->flags & HEAP_HARDEN_CANARY)
+    set_canary(h, aligned_blk);
+  return get_payload(aligned_blk);
+}
+
+/*
+ * Malloc a block whose payload is aligned to alignment bytes.
+ */
+void *heap_malloc_aligned(heap *h, size_t alignment, block_size_t size)
+{
+  void *payload;
+  if (lock_heap(h) != HEAP_OK)
+    return NULL;
+  payload = malloc_aligned_block(h, alignment, size);
+  unlock_heap(h);
+  return payload;
+}
+
 /*
  * wrapper function for get_size_to_allocate
  */
@@ -380,7 +3510,7 @@ block_size_t wrapper_get_size_to_allocate(block_size_t user_size){
  * wrapper function for prepare_block_for_use
  */
 void *wrapper_prepare_block_for_use(void *block_start, block_size_t real_size){
-  return prepare_block_for_use(block_start, real_size);
+  return prepare_block_for_use(block_start, real_size, MAX_UNUSED_BYTES);
 }
 
 /*
@@ -1,24 +1,59 @@
 #ifndef _IMPLICIT_H_
 #define _IMPLICIT_H_
 
+#include <stddef.h>
 #include <stdint.h>
-#include <stdalign.h>
 
 /*
- * Search algorithm used for the heap.
+ * Search algorithm used for the heap. HEAP_SEGNEXTFIT is next fit with a
+ * separate roving pointer for each size class of request.
  */
-typedef enum { HEAP_FIRSTFIT, HEAP_NEXTFIT, HEAP_BESTFIT } search_alg_t;
+typedef enum { HEAP_FIRSTFIT, HEAP_NEXTFIT, HEAP_BESTFIT, HEAP_SEGNEXTFIT } search_alg_t;
 
 /*
  * Maximum amount of empty space in a block.
  */
 #define MAX_UNUSED_BYTES 128
 
+/*
+ * Width in bits of block headers and footers. 32-bit tags keep small
+ * blocks compact but limit a heap to 4 GiB; build with HEAP_TAG_BITS=64
+ * for larger heaps.
+ */
+#ifndef HEAP_TAG_BITS
+#define HEAP_TAG_BITS 32
+#endif
+
+#if HEAP_TAG_BITS == 64
+typedef uint64_t block_size_t;
+#elif HEAP_TAG_BITS == 32
 typedef uint32_t block_size_t;
+#else
+#error "HEAP_TAG_BITS must be 32 or 64"
+#endif
 typedef uint64_t payload_align_t;
 
+/*
+ * Alignment of payloads in bytes, 8 or 16. The malloc replacement builds
+ * the heap with 16, the alignment malloc promises.
+ */
+#ifndef HEAP_PAYLOAD_ALIGN
+#define HEAP_PAYLOAD_ALIGN 8
+#endif
+
+#if HEAP_PAYLOAD_ALIGN != 8 && HEAP_PAYLOAD_ALIGN != 16
+#error "HEAP_PAYLOAD_ALIGN must be 8 or 16"
+#endif
+
 #define HEADER_SIZE (sizeof(block_size_t)) // same as footer size
-#define PAYLOAD_ALIGN (alignof(payload_align_t))
+#define PAYLOAD_ALIGN ((size_t) HEAP_PAYLOAD_ALIGN)
+
+/*
+ * Largest block a header can describe, and the largest request that can
+ * be served from such a block.
+ */
+#define MAX_BLOCK_SIZE ((block_size_t) -PAYLOAD_ALIGN)
+#define MAX_USER_SIZE (MAX_BLOCK_SIZE - 2 * HEADER_SIZE)
 
 /*
  * Struct used to represent the heap.
@@ -30,11 +65,182 @@ typedef struct heap {
     void *start;             /* Start address of the heap area. */
 } heap;
 
+/*
+ * Errors reported by the heap consistency checker and by heap_free on
+ * hardened heaps.
+ */
+typedef enum {
+    HEAP_OK = 0,
+    HEAP_ERR_SIZE,          /* A block size is zero or below the minimum. */
+    HEAP_ERR_TOTAL,         /* Block sizes do not add up to h->size. */
+    HEAP_ERR_FOOTER,        /* A block's header and footer disagree. */
+    HEAP_ERR_ADJACENT_FREE, /* Two consecutive blocks are both free. */
+    HEAP_ERR_NEXT,          /* h->next or a rover is not at a block boundary. */
+    HEAP_ERR_ALIGN,         /* A block or payload is misaligned. */
+    HEAP_ERR_RANGE,         /* A pointer lies outside the heap. */
+    HEAP_ERR_DOUBLE_FREE,   /* The block is already free or quarantined. */
+    HEAP_ERR_CANARY,        /* The guard word after a payload was overwritten. */
+    HEAP_ERR_TABLE,         /* The side table does not match the blocks. */
+    HEAP_ERR_LOCK,          /* The lock of a shared heap could not be taken. */
+    HEAP_ERR_HINT,          /* A free block's skip hint misses a free block. */
+    HEAP_ERR_FREE_SIZE      /* The size given to heap_free_sized does not fit the block. */
+} heap_error_t;
+
+/*
+ * Thoroughness of heap_check. The fast mode verifies header/footer
+ * agreement and that block sizes sum to the heap size. The deep mode
+ * also verifies coalescing, alignment and the next fit pointers.
+ */
+typedef enum { HEAP_CHECK_FAST, HEAP_CHECK_DEEP } heap_check_level_t;
+
+/*
+ * Binary heap snapshot written by heap_snapshot: a heap_snapshot_header
+ * followed by heap_snapshot_run records until end of file. Each run covers
+ * a maximal sequence of adjacent blocks that are all free or all in use.
+ */
+#define HEAP_SNAPSHOT_MAGIC 0x70616e73 /* "snap" */
+#define HEAP_SNAPSHOT_VERSION 1
+
+typedef struct heap_snapshot_header {
+    uint32_t magic;          /* HEAP_SNAPSHOT_MAGIC. */
+    uint32_t version;        /* HEAP_SNAPSHOT_VERSION. */
+    uint64_t heap_size;      /* Size of the block area in bytes. */
+} heap_snapshot_header;
+
+typedef struct heap_snapshot_run {
+    uint64_t offset;         /* Offset of the first block from h->start. */
+    uint64_t size;           /* Total size of the run in bytes. */
+    uint32_t blocks;         /* Number of blocks merged into the run. */
+    uint32_t in_use;         /* 1 if the blocks are in use, 0 if free. */
+} heap_snapshot_run;
+
 /*
  * Create a heap that is "size" bytes large.
  */
 heap *heap_create(intptr_t size, search_alg_t search_alg);
 
+/*
+ * Turn the heap back into a single free block in constant time. Every
+ * block allocated from it becomes invalid. Return 0 on success, -1 if the
+ * heap cannot be locked.
+ */
+int heap_reset(heap *h);
+
+/*
+ * Release a heap created by heap_create, heap_create_on_node,
+ * heap_create_huge or heap_create_guarded. Mapped heaps are unmapped.
+ * The memory of heap_create heaps is returned to the system once no
+ * memory above it is in use, and reused by heap_create until then.
+ * Persistent and shared heaps are released with heap_close instead:
+ * return -1 with errno set to EINVAL.
+ */
+int heap_destroy(heap *h);
+
+/*
+ * Open the persistent heap stored in the file at path, creating a heap
+ * that is "size" bytes large if the file is empty or missing. Blocks are
+ * located by offset only, so the heap may be mapped at a different address
+ * each time: store offsets from h->start rather than pointers in it.
+ * Return NULL and set errno on failure.
+ */
+heap *heap_open(const char *path, intptr_t size, search_alg_t search_alg);
+
+/*
+ * Flush a persistent heap to its file. Return 0 on success, -1 on error.
+ */
+int heap_sync(heap *h);
+
+/*
+ * Flush and close a persistent heap, or detach from a shared heap. Return
+ * 0 on success, -1 on error.
+ */
+int heap_close(heap *h);
+
+/*
+ * Create a heap that is "size" bytes large in its own mapping, with its
+ * memory placed on the given NUMA node. On systems without NUMA support
+ * the placement is left to the kernel.
+ */
+heap *heap_create_on_node(intptr_t size, search_alg_t search_alg, int node);
+
+/*
+ * Create a heap that is "size" bytes large in a mapping rounded up to
+ * whole 2 MiB pages, backed by huge pages to reduce TLB misses when walking it.
+ * Reserved hugetlbfs pages are used if available; otherwise the kernel is
+ * asked for transparent huge pages. heap_page_kind tells which one the
+ * heap got.
+ */
+heap *heap_create_huge(intptr_t size, search_alg_t search_alg);
+
+#define HEAP_PAGES_NORMAL 0      /* Base pages only. */
+#define HEAP_PAGES_HUGETLB 1     /* Reserved hugetlbfs pages. */
+#define HEAP_PAGES_TRANSPARENT 2 /* Transparent huge pages where the kernel can. */
+
+int heap_page_kind(heap *h);
+
+/*
+ * Create a heap that is "size" bytes large in its own mapping, with its
+ * control state, rovers and statistics out of band: they fill cache-aligned
+ * pages of their own, and PROT_NONE guard pages surround the block area.
+ * No block shares a cache line with the heap metadata, so threads working
+ * on blocks do not contend with updates of the metadata, and a payload
+ * overflow out of the block area faults instead of corrupting the heap.
+ */
+heap *heap_create_guarded(intptr_t size, search_alg_t search_alg);
+
+/*
+ * Return the number of NUMA nodes of the system, at least 1.
+ */
+int heap_numa_nodes(void);
+
+/*
+ * Make every operation on the heap take a lock, so that it can be used by
+ * several threads. Return 0 on success, -1 on error.
+ */
+int heap_set_thread_safe(heap *h);
+
+/*
+ * A set of thread-safe heaps, one on each NUMA node. heap_arenas_select
+ * returns the heap local to the calling thread, and heap_arenas_owner the
+ * heap a block must be freed to.
+ */
+typedef struct heap_arenas heap_arenas;
+
+heap_arenas *heap_arenas_create(intptr_t size_per_node, search_alg_t search_alg);
+heap *heap_arenas_select(heap_arenas *a);
+heap *heap_arenas_owner(heap_arenas *a, void *payload);
+void heap_arenas_destroy(heap_arenas *a);
+
+/*
+ * Create a heap that is "size" bytes large in shared memory. Other
+ * processes map the same heap with heap_attach_shared, given the
+ * descriptor from heap_shared_fd (inherited across fork, or passed over a
+ * Unix socket), and any of them may free blocks the others allocated.
+ * Every operation takes a robust process-shared lock, so a process that
+ * dies in the middle of one does not block the others. Processes map the
+ * heap at different addresses: exchange blocks with heap_offset and
+ * heap_pointer. Detach with heap_close. Return NULL on failure.
+ */
+heap *heap_create_shared(intptr_t size, search_alg_t search_alg);
+
+/*
+ * Map the shared heap behind the descriptor fd into this process.
+ */
+heap *heap_attach_shared(int fd, search_alg_t search_alg);
+
+/*
+ * Return the descriptor of a shared heap, or -1 for other heaps.
+ */
+int heap_shared_fd(heap *h);
+
+/*
+ * Convert between addresses in the heap and offsets from h->start, which
+ * stay the same in every process mapping a shared or persistent heap.
+ * heap_pointer returns NULL for offsets outside the heap.
+ */
+intptr_t heap_offset(heap *h, void *addr);
+void *heap_pointer(heap *h, intptr_t offset);
+
 /*
  * Print the structure of the heap to the screen.
  */
@@ -46,15 +252,241 @@ void heap_print(heap *h);
 block_size_t heap_find_avg_free_block_size(heap *h);
 
 /*
- * Free a block on the heap h.
+ * Write a run-length compressed snapshot of the heap to the file
+ * descriptor fd in a single pass. Return 0 on success, -1 on error.
+ */
+int heap_snapshot(heap *h, int fd);
+
+/*
+ * Verify the consistency of the heap in a single walk. Return HEAP_OK, or
+ * the first error found.
+ */
+heap_error_t heap_check(heap *h, heap_check_level_t level);
+
+/*
+ * Free a block on the heap h. Return HEAP_OK, or the reason the pointer
+ * was rejected on a hardened heap.
  */
-void heap_free(heap *h, void *payload);
+heap_error_t heap_free(heap *h, void *payload);
+
+/*
+ * Free a block that was allocated for "size" bytes. The only fast path is
+ * a prefetch of the block that follows it, located from the size; the free
+ * itself is that of heap_free. On heaps hardened with HEAP_HARDEN_FREE the
+ * size is checked against the block.
+ */
+heap_error_t heap_free_sized(heap *h, void *payload, block_size_t size);
+
+/*
+ * Free a block from a thread other than the one that owns the heap,
+ * without taking any lock. The block is queued, and freed by the owner
+ * during its next heap_malloc or heap_drain_remote_frees. Invalid frees
+ * are only detected, on hardened heaps, when the queue is drained.
+ */
+void heap_free_remote(heap *h, void *payload);
+
+/*
+ * Free the blocks queued by heap_free_remote. Must be called by the
+ * thread that owns the heap.
+ */
+void heap_drain_remote_frees(heap *h);
+
+/*
+ * Options of the background maintenance thread of a heap.
+ */
+typedef struct heap_maintenance {
+  unsigned interval_ms;  /* Time between maintenance passes. */
+  size_t trim_threshold; /* Trim free blocks of at least this many bytes, or 0. */
+} heap_maintenance;
+
+/*
+ * Start a thread that maintains the heap in the background, making the
+ * heap thread-safe. heap_free then only queues blocks, and every interval
+ * the thread frees and coalesces the queued blocks, records walk hints for
+ * the searches of heap_malloc and trims large free blocks. Blocks are still
+ * freed on the spot on heaps hardened with HEAP_HARDEN_FREE, so that bad
+ * frees are reported. Shared heaps cannot be maintained. Return 0 on
+ * success, -1 on error.
+ */
+int heap_start_maintenance(heap *h, const heap_maintenance *opts);
+
+/*
+ * Stop the maintenance thread of a heap, if it has one, and free the
+ * blocks it left queued.
+ */
+void heap_stop_maintenance(heap *h);
+
+/*
+ * Give the memory of free blocks of at least min_size bytes back to the
+ * system, keeping their headers, footers and walk hints. Does nothing for
+ * persistent and shared heaps. Return the number of bytes released.
+ */
+size_t heap_trim(heap *h, size_t min_size);
+
+/*
+ * Hardening options for heap_set_hardening. Compiling implicit.c with
+ * HEAP_HARDENED defined turns all of them on for every new heap.
+ */
+#define HEAP_HARDEN_CANARY 0x1     /* Guard word after every payload. */
+#define HEAP_HARDEN_FREE 0x2       /* Reject invalid and double frees. */
+#define HEAP_HARDEN_QUARANTINE 0x4 /* Delay the reuse of freed blocks. */
+#define HEAP_HARDEN_ALL 0x7
+
+/*
+ * Select the hardening options of a heap. Must be called before the first
+ * allocation when enabling canaries.
+ */
+void heap_set_hardening(heap *h, int flags);
+
+/*
+ * Maintain a side table holding the header of every block in address
+ * order, and search it with vector instructions instead of walking the
+ * heap. Return 0 on success, -1 if the table could not be set up.
+ */
+int heap_enable_side_table(heap *h);
+
+/*
+ * Stop maintaining the side table and release its memory.
+ */
+void heap_disable_side_table(heap *h);
+
+/*
+ * Split policy of a heap. A free block handed out for a smaller request is
+ * split when the unused part is larger than the request or at least
+ * split_threshold bytes. A higher threshold wastes more memory inside
+ * blocks but leaves fewer, larger blocks to search, split and coalesce.
+ * The adaptive policy doubles the threshold while internal waste stays
+ * under half of waste_percent of the allocated bytes and many blocks are
+ * split, and halves it when waste exceeds waste_percent. It is reviewed
+ * every HEAP_SPLIT_ADAPT_INTERVAL allocations.
+ *
+ * Searches that walk the blocks give up after wilderness_probe blocks
+ * without a fit, and take the request from the wilderness, the free
+ * block at the end of the heap, when it is large enough. While a heap
+ * mostly allocates, each malloc then costs a short probe and a split at
+ * the end of the heap instead of a walk over every block. The probe is
+ * off, 0, by default, which keeps blocks placed in address order.
+ */
+typedef struct heap_tuning {
+  block_size_t split_threshold; /* Unused bytes worth a split, at least 2 * HEADER_SIZE. */
+  int adaptive;                 /* Adjust split_threshold automatically. */
+  unsigned waste_percent;       /* Internal waste the adaptive policy accepts. */
+  unsigned wilderness_probe;    /* Blocks searched before the wilderness, 0 to disable. */
+} heap_tuning;
+
+#define HEAP_SPLIT_ADAPT_INTERVAL 1024
+
+/*
+ * Counters of the split policy since the heap was created.
+ */
+typedef struct heap_split_stats {
+  uint64_t allocs;    /* Free blocks handed out by malloc. */
+  uint64_t bytes;     /* Bytes those allocations needed, headers included. */
+  uint64_t waste;     /* Unused bytes left inside blocks handed out whole. */
+  uint64_t splits;    /* Blocks split to serve an allocation. */
+  uint64_t coalesces; /* Free blocks merged with a free neighbour. */
+} heap_split_stats;
+
+/*
+ * Read or change the split policy and wilderness probe of a heap.
+ * heap_set_tuning returns -1 with errno set to EINVAL if the threshold is
+ * out of range.
+ */
+void heap_get_tuning(heap *h, heap_tuning *tuning);
+int heap_set_tuning(heap *h, const heap_tuning *tuning);
+
+/*
+ * Read the split policy counters of a heap.
+ */
+void heap_get_split_stats(heap *h, heap_split_stats *stats);
+
+/*
+ * Sampling allocation profiler. Once started, 1 in about "rate" calls to
+ * heap_malloc is sampled: its requested size, its call site and, when the
+ * block is freed, its lifetime. Samples are aggregated per call site and
+ * per power of two size class. A heap that is not profiled pays one test
+ * per malloc and free.
+ */
+typedef struct heap_profile_entry {
+  void *site;           /* Return address of the heap_malloc call, or NULL. */
+  uint64_t max_size;    /* Largest sampled request. */
+  uint64_t allocs;      /* Sampled allocations. */
+  uint64_t bytes;       /* Bytes they requested. */
+  uint64_t frees;       /* Sampled allocations freed so far. */
+  uint64_t lifetime_ns; /* Total lifetime of the freed ones. */
+} heap_profile_entry;
+
+/*
+ * Start profiling a heap, sampling 1 in "rate" mallocs on average, or
+ * change the rate of a profiled heap. Return 0 on success, -1 on error.
+ */
+int heap_profile_start(heap *h, unsigned rate);
+
+/*
+ * Stop profiling a heap and discard its samples.
+ */
+void heap_profile_stop(heap *h);
+
+/*
+ * Copy up to max call site or size class entries of a profiled heap into
+ * entries, most bytes first. Return the number of entries there are.
+ */
+size_t heap_profile_sites(heap *h, heap_profile_entry *entries, size_t max);
+size_t heap_profile_classes(heap *h, heap_profile_entry *entries, size_t max);
+
+/*
+ * Write a report of the samples of a profiled heap to fd, with counts and
+ * bytes scaled up by the sampling rate. Return 0 on success, -1 on error.
+ */
+int heap_profile_report(heap *h, int fd);
 
 /*
  * Our implementation of malloc.
  */
 void *heap_malloc(heap *h, block_size_t size);
 
+/*
+ * Resize a block allocated by heap_malloc, moving it if needed. Behaves
+ * like heap_malloc if payload is NULL and like heap_free if size is 0.
+ */
+void *heap_realloc(heap *h, void *payload, block_size_t size);
+
+/*
+ * Malloc a block whose payload is aligned to "alignment" bytes, which must
+ * be a power of two. The block is freed with heap_free.
+ */
+void *heap_malloc_aligned(heap *h, size_t alignment, block_size_t size);
+
+/*
+ * Expected lifetime of a block, for heap_malloc_hint. Short-lived blocks
+ * are placed by the search policy of the heap, which fills it from the
+ * bottom, and long-lived blocks are carved from the top of the highest
+ * free block that fits, so that they do not pin the holes left by the
+ * short-lived ones.
+ */
+#define HEAP_HINT_NONE 0  /* Same as heap_malloc. */
+#define HEAP_HINT_SHORT 1 /* Freed soon after it is allocated. */
+#define HEAP_HINT_LONG 2  /* Kept for much of the life of the heap. */
+
+/*
+ * Malloc a block whose expected lifetime is given by hint, one of the
+ * HEAP_HINT_* values. The block is freed with heap_free.
+ */
+void *heap_malloc_hint(heap *h, block_size_t size, int hint);
+
+/*
+ * Malloc a zeroed block for nmemb elements of size bytes. Blocks carved
+ * from memory that is still zero from the system, or from heap_trim, are
+ * not cleared again. Return NULL if the product overflows.
+ */
+void *heap_calloc(heap *h, size_t nmemb, size_t size);
+
+/*
+ * Return the number of usable bytes in an allocated block, which may be
+ * more than requested.
+ */
+size_t heap_usable_size(heap *h, void *payload);
+
 /*
  * wrapper function for get_size_to_allocate
  */
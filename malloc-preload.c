@@ -0,0 +1,342 @@
+/*
+ * Drop-in replacement for the C library allocator, backed by a single
+ * implicit free list heap. Build libimplicit.so and run a program with
+ *
+ *   LD_PRELOAD=./libimplicit.so program
+ *
+ * The heap is configured from the environment on first use:
+ *
+ *   IMPLICIT_HEAP_SIZE   size of the heap in bytes (default 1 GiB)
+ *   IMPLICIT_SEARCH      first, next, best or segnext (default first)
+ *   IMPLICIT_SIDE_TABLE  if set, search through a side table
+ *   IMPLICIT_HARDENED    if set, enable all hardening and abort on bad frees
+ *   IMPLICIT_GUARDED     if set, keep the heap metadata apart from the blocks,
+ *                        behind guard pages
+ *
+ * Requests the heap cannot serve, and pointers it did not hand out, are
+ * passed on to the next allocator in the link chain (normally glibc).
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "implicit.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+/*
+ * Default size of the heap, size of the static buffer that serves
+ * allocations made while the next allocator is being looked up, and the
+ * alignment malloc guarantees.
+ */
+#define DEFAULT_HEAP_SIZE ((intptr_t) 1 << 30)
+#define BOOTSTRAP_SIZE (64 * 1024)
+#define MALLOC_ALIGN (alignof(max_align_t))
+
+/*
+ * The library is built with HEAP_PAYLOAD_ALIGN=16, so every heap payload
+ * already has the alignment of malloc.
+ */
+_Static_assert(PAYLOAD_ALIGN >= MALLOC_ALIGN,
+	       "build the heap of libimplicit.so with HEAP_PAYLOAD_ALIGN=16");
+
+static heap *the_heap;
+static int heap_failed;
+static int heap_hardened;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Allocations made while dlsym looks up the next allocator come from this
+ * buffer and are never freed.
+ */
+static alignas(64) char bootstrap[BOOTSTRAP_SIZE];
+static size_t bootstrap_used;
+static __thread int in_setup __attribute__((tls_model("initial-exec")));
+
+/*
+ * Next allocator in the link chain.
+ */
+static void *(*next_malloc)(size_t);
+static void (*next_free)(void *);
+static void *(*next_realloc)(void *, size_t);
+static int (*next_posix_memalign)(void **, size_t, size_t);
+static size_t (*next_usable_size)(void *);
+
+/*
+ * Serve a request from the bootstrap buffer. Return NULL once it is full.
+ */
+static void *bootstrap_alloc(size_t alignment, size_t size)
+{
+  size_t used = __atomic_load_n(&bootstrap_used, __ATOMIC_RELAXED);
+  size_t start, end;
+  do {
+    start = (used + alignment - 1) & -alignment;
+    end = start + size;
+    if (end > BOOTSTRAP_SIZE || end < start)
+      return NULL;
+  } while (!__atomic_compare_exchange_n(&bootstrap_used, &used, end, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return bootstrap + start;
+}
+
+/*
+ * Determine whether ptr was served from the bootstrap buffer.
+ */
+static int is_bootstrap(void *ptr)
+{
+  return (char *) ptr >= bootstrap && (char *) ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+/*
+ * Look up the next allocator. Allocations dlsym makes meanwhile are served
+ * from the bootstrap buffer.
+ */
+static void resolve_next()
+{
+  if (__atomic_load_n(&next_usable_size, __ATOMIC_ACQUIRE) != NULL)
+    return;
+  in_setup = 1;
+  next_malloc = dlsym(RTLD_NEXT, "malloc");
+  next_free = dlsym(RTLD_NEXT, "free");
+  next_realloc = dlsym(RTLD_NEXT, "realloc");
+  next_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+  __atomic_store_n(&next_usable_size, dlsym(RTLD_NEXT, "malloc_usable_size"),
+		   __ATOMIC_RELEASE);
+  in_setup = 0;
+}
+
+/*
+ * Return the heap, creating it on first use. Called with heap_lock held.
+ */
+static heap *get_heap()
+{
+  if (the_heap != NULL || heap_failed)
+    return the_heap;
+
+  const char *env = getenv("IMPLICIT_HEAP_SIZE");
+  intptr_t size = env ? strtoll(env, NULL, 0) : DEFAULT_HEAP_SIZE;
+  search_alg_t search_alg = HEAP_FIRSTFIT;
+  env = getenv("IMPLICIT_SEARCH");
+  if (env != NULL && strcmp(env, "next") == 0)
+    search_alg = HEAP_NEXTFIT;
+  else if (env != NULL && strcmp(env, "best") == 0)
+    search_alg = HEAP_BESTFIT;
+  else if (env != NULL && strcmp(env, "segnext") == 0)
+    search_alg = HEAP_SEGNEXTFIT;
+
+  heap *h = getenv("IMPLICIT_GUARDED") != NULL
+    ? heap_create_guarded(size, search_alg) : heap_create(size, search_alg);
+  if (h == NULL) {
+    heap_failed = 1;
+    return NULL;
+  }
+  if (getenv("IMPLICIT_SIDE_TABLE") != NULL)
+    heap_enable_side_table(h);
+  if (getenv("IMPLICIT_HARDENED") != NULL) {
+    heap_set_hardening(h, HEAP_HARDEN_ALL);
+    heap_hardened = 1;
+  }
+  __atomic_store_n(&the_heap, h, __ATOMIC_RELEASE);
+  return h;
+}
+
+/*
+ * Determine whether ptr lies in the heap. The heap never moves once
+ * created, so this needs no lock.
+ */
+static int is_heap_pointer(void *ptr)
+{
+  heap *h = __atomic_load_n(&the_heap, __ATOMIC_ACQUIRE);
+  return h != NULL && ptr >= h->start && ptr < h->start + h->size;
+}
+
+/*
+ * Allocate from the heap with the given alignment, falling back on the
+ * next allocator. Only alignments above that of every payload take the
+ * aligned path of the heap. Return NULL only when both fail.
+ */
+static void *allocate(size_t alignment, size_t size)
+{
+  void *p = NULL;
+
+  if (in_setup)
+    return bootstrap_alloc(alignment, size ? size : 1);
+  if (size == 0)
+    size = 1;
+
+  if (size <= MAX_USER_SIZE) {
+    pthread_mutex_lock(&heap_lock);
+    heap *h = get_heap();
+    if (h != NULL)
+      p = alignment <= PAYLOAD_ALIGN ? heap_malloc(h, size)
+	: heap_malloc_aligned(h, alignment, size);
+    pthread_mutex_unlock(&heap_lock);
+    if (p != NULL)
+      return p;
+  }
+
+  resolve_next();
+  if (alignment <= MALLOC_ALIGN && next_malloc != NULL)
+    p = next_malloc(size);
+  else if (next_posix_memalign != NULL && next_posix_memalign(&p, alignment, size) != 0)
+    p = NULL;
+  if (p == NULL)
+    errno = ENOMEM;
+  return p;
+}
+
+/*
+ * Free a heap block, aborting on a rejected pointer in hardened mode.
+ */
+static void release(void *ptr)
+{
+  pthread_mutex_lock(&heap_lock);
+  heap_error_t err = heap_free(the_heap, ptr);
+  pthread_mutex_unlock(&heap_lock);
+  if (err != HEAP_OK && heap_hardened) {
+    static const char msg[] = "libimplicit: invalid free detected, aborting\n";
+    if (write(STDERR_FILENO, msg, sizeof(msg) - 1)) {}
+    abort();
+  }
+}
+
+EXPORT void *malloc(size_t size)
+{
+  return allocate(MALLOC_ALIGN, size);
+}
+
+EXPORT void free(void *ptr)
+{
+  if (ptr == NULL || is_bootstrap(ptr))
+    return;
+  if (is_heap_pointer(ptr)) {
+    release(ptr);
+    return;
+  }
+  resolve_next();
+  if (next_free != NULL)
+    next_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+  size_t total;
+  if (__builtin_mul_overflow(nmemb, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  void *p = allocate(MALLOC_ALIGN, total);
+  if (p != NULL && !is_bootstrap(p))
+    memset(p, 0, total);
+  return p;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+  void *p;
+
+  if (ptr == NULL)
+    return malloc(size);
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  if (is_bootstrap(ptr)) {
+    p = malloc(size);
+    if (p != NULL) {
+      size_t avail = bootstrap + BOOTSTRAP_SIZE - (char *) ptr;
+      memcpy(p, ptr, avail < size ? avail : size);
+    }
+    return p;
+  }
+
+  if (!is_heap_pointer(ptr)) {
+    resolve_next();
+    return next_realloc != NULL ? next_realloc(ptr, size) : NULL;
+  }
+
+  if (size <= MAX_USER_SIZE) {
+    pthread_mutex_lock(&heap_lock);
+    p = heap_realloc(the_heap, ptr, size);
+    pthread_mutex_unlock(&heap_lock);
+    if (p != NULL)
+      return p;
+  }
+
+  /* The heap is full: move the block to the next allocator */
+  size_t old_size = malloc_usable_size(ptr);
+  p = allocate(MALLOC_ALIGN, size);
+  if (p != NULL) {
+    memcpy(p, ptr, old_size < size ? old_size : size);
+    free(ptr);
+  }
+  return p;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  void *p = allocate(alignment < MALLOC_ALIGN ? MALLOC_ALIGN : alignment, size);
+  if (p == NULL)
+    return ENOMEM;
+  *memptr = p;
+  return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+  void *p = NULL;
+  int err = posix_memalign(&p, alignment, size);
+  if (err != 0)
+    errno = err;
+  return p;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+  return aligned_alloc(alignment, size);
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+  size_t size;
+  if (ptr == NULL || is_bootstrap(ptr))
+    return 0;
+  if (is_heap_pointer(ptr)) {
+    pthread_mutex_lock(&heap_lock);
+    size = heap_usable_size(the_heap, ptr);
+    pthread_mutex_unlock(&heap_lock);
+    return size;
+  }
+  resolve_next();
+  return next_usable_size != NULL ? next_usable_size(ptr) : 0;
+}
+
+/*
+ * Keep the heap consistent across fork by holding its lock while the
+ * process is copied.
+ */
+static void before_fork()
+{
+  pthread_mutex_lock(&heap_lock);
+}
+
+static void after_fork()
+{
+  pthread_mutex_unlock(&heap_lock);
+}
+
+__attribute__((constructor))
+static void preload_init()
+{
+  pthread_atfork(before_fork, after_fork, after_fork);
+}
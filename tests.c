@@ -1,19 +1,60 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "tests.h"
 #include "implicit.h"
 
+/*
+ * Specialized allocator with a layout the generic heap cannot use.
+ */
+#define SPEC_NAME spec_wide
+#define SPEC_FIT HEAP_FIRSTFIT
+#define SPEC_TAG uint64_t
+#define SPEC_ALIGN 16
+#define SPEC_SPLIT 64
+#include "implicit-spec.h"
+
+/*
+ * destroy the heaps of the previous test, newest first so their memory is
+ * returned to the system
+ */
+void release_heaps(heap** h_0, heap** h_1, heap** h_2){
+  heap** heaps[] = { h_2, h_1, h_0 };
+  int i;
+  for(i = 0; i < 3; i++){
+    if(*heaps[i] != NULL)
+      heap_destroy(*heaps[i]);
+    *heaps[i] = NULL;
+  }
+}
+
+/*
+ * Bytes the test heaps gain with 64-bit tags, which leave no alignment
+ * padding in front of the first block. They go to a block in use, so that
+ * the free blocks keep the same sizes for both tag widths.
+ */
+#define FIXTURE_SLACK (2 * HEADER_SIZE - 8)
+
 /*
  * initialize 3 heaps with given searching algorithm:
  * h_0: a 64B heap with a single 24B free block
  * h_1: a 256B heap with blocks: 16B(u)-32B(f)-64B(f)-32B(f)-16B(u)-32B(u)-24B(f)
  * h_2: a 1024B heap with blocks: 48B(u)-512B(f)-424B(f)
+ * With 64-bit tags, h_0's block and h_1's fifth and h_2's first blocks are
+ * FIXTURE_SLACK bytes larger.
  */
 void initialize_heaps(heap** h_0, heap** h_1, heap** h_2, search_alg_t search_alg){
   void* block_start;
+  release_heaps(h_0, h_1, h_2);
   *h_0 = heap_create(64, search_alg);
   *h_1 = heap_create(256, search_alg);
   *h_2 = heap_create(1024, search_alg);
@@ -24,8 +65,8 @@ void initialize_heaps(heap** h_0, heap** h_1, heap** h_2, search_alg_t search_al
   }
 
   block_start = (*h_0)->start;
-  wrapper_set_block_header(block_start, 24, 0);
-  if(!wrapper_is_within_heap_range(*h_0, block_start + 23)){
+  wrapper_set_block_header(block_start, 24 + FIXTURE_SLACK, 0);
+  if(!wrapper_is_within_heap_range(*h_0, block_start + 23 + FIXTURE_SLACK)){
     printf("ERROR: dividing blocks for h_0 failed");
     return;
   }
@@ -39,8 +80,8 @@ void initialize_heaps(heap** h_0, heap** h_1, heap** h_2, search_alg_t search_al
   block_start += 64;
   wrapper_set_block_header(block_start, 32, 0);
   block_start += 32;
-  wrapper_set_block_header(block_start, 16, 1);
-  block_start += 16;
+  wrapper_set_block_header(block_start, 16 + FIXTURE_SLACK, 1);
+  block_start += 16 + FIXTURE_SLACK;
   wrapper_set_block_header(block_start, 32, 1);
   block_start += 32;
   wrapper_set_block_header(block_start, 24, 0);
@@ -50,8 +91,8 @@ void initialize_heaps(heap** h_0, heap** h_1, heap** h_2, search_alg_t search_al
   }
 
   block_start = (*h_2)->start;
-  wrapper_set_block_header(block_start, 48, 1);
-  block_start += 48;
+  wrapper_set_block_header(block_start, 48 + FIXTURE_SLACK, 1);
+  block_start += 48 + FIXTURE_SLACK;
   wrapper_set_block_header(block_start, 512, 0);
   block_start += 512;
   wrapper_set_block_header(block_start, 424, 0);
@@ -185,7 +226,7 @@ void test_coalesce_case_1(heap **h_0, heap **h_1, heap **h_2){
   blk = wrapper_coalesce(*h_1, blk);
   if(blk != NULL
       && wrapper_get_block_size(blk) == 32
-      && wrapper_get_block_size(wrapper_get_next_block(blk)) == 16){}
+      && wrapper_get_block_size(wrapper_get_next_block(blk)) == 16 + FIXTURE_SLACK){}
   else{
     printf("call coalesce when following block is occupied test failed\n");
   }
@@ -239,7 +280,7 @@ void test_coalesce_case_3(heap **h_0, heap **h_1, heap **h_2){
 void test_malloc_first_fit_case_0(heap** h_0, heap** h_1, heap** h_2){
   void* payload = NULL;
   void* blk = NULL;
-  payload = heap_malloc(*h_1, 55);
+  payload = heap_malloc(*h_1, 63 - 2 * HEADER_SIZE);
   if(payload != NULL)
     blk = wrapper_get_block_start(payload);
   if(payload != NULL
@@ -267,7 +308,7 @@ void test_malloc_first_fit_case_1(heap** h_0, heap** h_1, heap** h_2){
  *       split to 128B(u) and 384B(f)
  */
 void test_malloc_first_fit_case_2(heap** h_0, heap** h_1, heap** h_2){
-  void* payload = heap_malloc(*h_2, 120);
+  void* payload = heap_malloc(*h_2, 128 - 2 * HEADER_SIZE);
   void* blk = NULL;
   if(payload != NULL)
     blk = wrapper_get_block_start(payload);
@@ -314,6 +355,8 @@ void test_malloc_best_fit_case_1(heap** h_0, heap** h_1, heap** h_2){
   blk = wrapper_get_next_block(blk);
   blk = wrapper_get_next_block(blk);
   wrapper_set_block_header(blk, wrapper_get_block_size(blk), 0); // set 4th block to free
+  void* last = wrapper_get_next_block(wrapper_get_next_block(blk));
+  wrapper_set_block_header(last, wrapper_get_block_size(last), 1); // ties with it on 64-bit tags
 
   void* payload =heap_malloc(*h_1, 5);
   if(payload != NULL
@@ -329,7 +372,7 @@ void test_malloc_best_fit_case_1(heap** h_0, heap** h_1, heap** h_2){
  *       2nd block
  */
 void test_malloc_best_fit_case_2(heap** h_0, heap** h_1, heap** h_2){
-  void* payload = heap_malloc(*h_2, 120);
+  void* payload = heap_malloc(*h_2, 128 - 2 * HEADER_SIZE);
   void* blk = NULL;
   if(payload != NULL)
     blk = wrapper_get_block_start(payload);
@@ -443,7 +486,7 @@ void test_malloc_next_fit_case_3(heap** h_0, heap** h_1, heap** h_2){
   }
   (*h_1)->next = blk;
   void* prev_next = (*h_1)->next;
-  void* payload = heap_malloc(*h_1, 24);
+  void* payload = heap_malloc(*h_1, 32 - 2 * HEADER_SIZE);
   void* curr_next = (*h_1)->next;
   
   if(payload != NULL
@@ -475,20 +518,1607 @@ void test_malloc_next_fit_case_4(heap** h_0, heap** h_1, heap** h_2){
   }
 }
 
+/* case: snapshot of h_1 merges adjacent blocks in the same state,
+ *       expects runs 16B(u)-128B(f, 3 blocks)-48B(u, 2 blocks)-24B(f)
+ */
+void test_heap_snapshot_case_0(heap **h_0, heap **h_1, heap **h_2){
+  FILE* f = tmpfile();
+  heap_snapshot_header hdr = { 0 };
+  heap_snapshot_run runs[5];
+  size_t nb_runs = 0;
+
+  if(f != NULL && heap_snapshot(*h_1, fileno(f)) == 0){
+    rewind(f);
+    if(fread(&hdr, sizeof(hdr), 1, f) == 1)
+      nb_runs = fread(runs, sizeof(heap_snapshot_run), 5, f);
+  }
+  if(f != NULL
+      && hdr.magic == HEAP_SNAPSHOT_MAGIC
+      && hdr.heap_size == (*h_1)->size
+      && nb_runs == 4
+      && runs[0].offset == 0 && runs[0].size == 16 && runs[0].in_use
+      && runs[1].offset == 16 && runs[1].size == 128 && runs[1].blocks == 3 && !runs[1].in_use
+      && runs[2].offset == 144 && runs[2].size == 48 + FIXTURE_SLACK && runs[2].blocks == 2 && runs[2].in_use
+      && runs[3].offset == 192 + FIXTURE_SLACK && runs[3].size == 24 && !runs[3].in_use){}
+  else{
+    printf("snapshot of h_1 test failed\n");
+  }
+  if(f != NULL)
+    fclose(f);
+}
+
+/* case: freshly created heap and h_0 pass both check levels, h_1 passes
+ *       the fast check but has adjacent free blocks
+ */
+void test_heap_check_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1024, HEAP_FIRSTFIT);
+  if(h != NULL
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK
+      && heap_check(*h_0, HEAP_CHECK_DEEP) == HEAP_OK
+      && heap_check(*h_1, HEAP_CHECK_FAST) == HEAP_OK
+      && heap_check(*h_1, HEAP_CHECK_DEEP) == HEAP_ERR_ADJACENT_FREE){}
+  else{
+    printf("check of well-formed heaps test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: footer of the 2nd block of h_2 overwritten, expects footer error
+ */
+void test_heap_check_case_1(heap **h_0, heap **h_1, heap **h_2){
+  void* blk = wrapper_get_next_block((*h_2)->start); // 512B free block
+  *((block_size_t *) (blk + 512 - HEADER_SIZE)) = 256;
+  if(heap_check(*h_2, HEAP_CHECK_FAST) == HEAP_ERR_FOOTER){}
+  else{
+    printf("check of heap with corrupted footer test failed\n");
+  }
+}
+
+/* case: size of the 2nd block of h_1 set to 0, expects size error rather
+ *       than an endless walk
+ */
+void test_heap_check_case_2(heap **h_0, heap **h_1, heap **h_2){
+  void* blk = wrapper_get_next_block((*h_1)->start);
+  *((block_size_t *) blk) = 0;
+  if(heap_check(*h_1, HEAP_CHECK_FAST) == HEAP_ERR_SIZE){}
+  else{
+    printf("check of heap with zero sized block test failed\n");
+  }
+}
+
+/* case: last block of h_1 claims to be larger than the rest of the heap,
+ *       expects total size error
+ */
+void test_heap_check_case_3(heap **h_0, heap **h_1, heap **h_2){
+  void* blk = (*h_1)->start;
+  int i;
+  for(i=0; i<6; i++){
+    blk = wrapper_get_next_block(blk);
+  }
+  *((block_size_t *) blk) = 64;
+  if(heap_check(*h_1, HEAP_CHECK_FAST) == HEAP_ERR_TOTAL){}
+  else{
+    printf("check of heap with oversized last block test failed\n");
+  }
+}
+
+/* case: h_0->next points inside its only block, expects next error in
+ *       deep mode only
+ */
+void test_heap_check_case_4(heap **h_0, heap **h_1, heap **h_2){
+  (*h_0)->next = (*h_0)->start + PAYLOAD_ALIGN;
+  if(heap_check(*h_0, HEAP_CHECK_FAST) == HEAP_OK
+      && heap_check(*h_0, HEAP_CHECK_DEEP) == HEAP_ERR_NEXT){}
+  else{
+    printf("check of heap with misplaced next pointer test failed\n");
+  }
+}
+
+/* case: hardened heap rejects a second free of the same block, and a
+ *       pointer outside the heap, without touching the heap
+ */
+void test_hardened_free_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1024, HEAP_FIRSTFIT);
+  heap_set_hardening(h, HEAP_HARDEN_CANARY | HEAP_HARDEN_FREE);
+  void* payload = heap_malloc(h, 40);
+  heap_malloc(h, 40);
+  int outside;
+
+  if(payload != NULL
+      && heap_free(h, payload) == HEAP_OK
+      && heap_free(h, payload) == HEAP_ERR_DOUBLE_FREE
+      && heap_free(h, &outside) == HEAP_ERR_RANGE
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK){}
+  else{
+    printf("hardened heap double free and out of range free test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: hardened heap rejects misaligned and interior pointers
+ */
+void test_hardened_free_case_1(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1024, HEAP_FIRSTFIT);
+  heap_set_hardening(h, HEAP_HARDEN_FREE);
+  char* payload = heap_malloc(h, 200);
+  if(payload != NULL)
+    memset(payload, 0, 200);
+
+  if(payload != NULL
+      && heap_free(h, payload + 3) == HEAP_ERR_ALIGN
+      && heap_free(h, payload + 64) != HEAP_OK
+      && heap_free(h, payload) == HEAP_OK
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK){}
+  else{
+    printf("hardened heap interior pointer free test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: writing past the end of a payload overwrites the canary, and
+ *       the free is rejected
+ */
+void test_hardened_free_case_2(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1024, HEAP_FIRSTFIT);
+  heap_set_hardening(h, HEAP_HARDEN_CANARY | HEAP_HARDEN_FREE);
+  char* payload = heap_malloc(h, 16);
+  void* blk = NULL;
+  if(payload != NULL){
+    blk = wrapper_get_block_start(payload);
+    payload[wrapper_get_block_size(blk) - 2 * HEADER_SIZE - 1] = 0;
+  }
+
+  if(payload != NULL
+      && heap_free(h, payload) == HEAP_ERR_CANARY
+      && wrapper_block_is_in_use(blk)){}
+  else{
+    printf("hardened heap canary overwrite test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: quarantined block is not reused by the next malloc, and freeing
+ *       it again is reported as a double free
+ */
+void test_hardened_free_case_3(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1024, HEAP_FIRSTFIT);
+  heap_set_hardening(h, HEAP_HARDEN_ALL);
+  void* payload = heap_malloc(h, 32);
+  heap_malloc(h, 32);
+
+  if(payload != NULL
+      && heap_free(h, payload) == HEAP_OK
+      && heap_malloc(h, 32) != payload
+      && heap_free(h, payload) == HEAP_ERR_DOUBLE_FREE){}
+  else{
+    printf("hardened heap quarantine test failed\n");
+  }
+  heap_set_hardening(h, 0);
+  if(!wrapper_block_is_in_use(wrapper_get_block_start(payload))){}
+  else{
+    printf("flushing hardened heap quarantine test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: heaps too small for one block, or too large for the block tags,
+ *       are rejected; with 64-bit tags a heap over 4 GiB serves a block
+ *       over 4 GiB
+ */
+void test_heap_create_case_0(heap **h_0, heap **h_1, heap **h_2){
+  intptr_t large = (intptr_t) 5 << 30;
+  if(heap_create(16, HEAP_FIRSTFIT) == NULL){}
+  else{
+    printf("create heap smaller than a block test failed\n");
+  }
+#if HEAP_TAG_BITS == 32
+  if(heap_create(large, HEAP_FIRSTFIT) == NULL){}
+  else{
+    printf("create heap over 4 GiB with 32-bit tags test failed\n");
+  }
+#else
+  heap* h = heap_create(large, HEAP_BESTFIT);
+  void* payload = NULL;
+  if(h != NULL)
+    payload = heap_malloc(h, (block_size_t) 9 << 29);
+  if(h != NULL
+      && payload != NULL
+      && wrapper_get_block_size(wrapper_get_block_start(payload)) > ((block_size_t) 1 << 32)
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK
+      && heap_find_avg_free_block_size(h) == h->size - wrapper_get_size_to_allocate((block_size_t) 9 << 29)){}
+  else{
+    printf("create heap over 4 GiB with 64-bit tags test failed\n");
+  }
+  if(h != NULL)
+    heap_destroy(h);
+#endif
+}
+
+/* case: specialized heap with 64-bit tags and 16B alignment returns
+ *       aligned payloads, splits by its own threshold, and coalesces
+ *       back to a single free block
+ */
+void test_spec_heap_case_0(heap **h_0, heap **h_1, heap **h_2){
+  spec_wide_heap* h = spec_wide_create(1024);
+  unsigned long empty_size = 0;
+  void* a = NULL;
+  void* b = NULL;
+  void* c = NULL;
+  if(h != NULL){
+    empty_size = spec_wide_avg_free_block_size(h);
+    a = spec_wide_malloc(h, 1);     // 32B block
+    b = spec_wide_malloc(h, 100);   // 128B block
+    c = spec_wide_malloc(h, 8);
+  }
+  if(h != NULL && a != NULL && b != NULL && c != NULL
+      && (uintptr_t) a % 16 == 0
+      && (uintptr_t) b % 16 == 0
+      && b - a == 32
+      && c - b == 128){
+    spec_wide_free(h, b);
+    spec_wide_free(h, a);
+    spec_wide_free(h, c);
+  }
+  else{
+    printf("specialized heap malloc test failed\n");
+    spec_wide_destroy(h);
+    return;
+  }
+  if(empty_size > 0 && spec_wide_avg_free_block_size(h) == empty_size){}
+  else{
+    printf("specialized heap free test failed\n");
+  }
+  spec_wide_destroy(h);
+}
+
+/* case: for each search algorithm, a heap searched through its side table
+ *       returns the same blocks as a heap searched by walking the headers,
+ *       over a sequence of random mallocs and frees
+ */
+void test_side_table_case_0(heap **h_0, heap **h_1, heap **h_2){
+  search_alg_t algs[] = { HEAP_FIRSTFIT, HEAP_NEXTFIT, HEAP_BESTFIT, HEAP_SEGNEXTFIT };
+  int a, i;
+  for(a=0; a<4; a++){
+    heap* walked = heap_create(1 << 16, algs[a]);
+    heap* indexed = heap_create(1 << 16, algs[a]);
+    char* walked_ptrs[64];
+    char* indexed_ptrs[64];
+    int nb_pointers = 0;
+    unsigned int seed = 261;
+    int failed = heap_enable_side_table(indexed) != 0;
+
+    for(i=0; i<4000 && !failed; i++){
+      seed = seed * 1103515245 + 12345;
+      if(nb_pointers < 64 && (nb_pointers == 0 || (seed >> 16) % 3 != 0)){
+        block_size_t size = (seed >> 8) % 1500 + 1;
+        walked_ptrs[nb_pointers] = heap_malloc(walked, size);
+        indexed_ptrs[nb_pointers] = heap_malloc(indexed, size);
+        if((walked_ptrs[nb_pointers] == NULL) != (indexed_ptrs[nb_pointers] == NULL)
+            || (walked_ptrs[nb_pointers] != NULL
+                && walked_ptrs[nb_pointers] - (char*) walked->start
+                   != indexed_ptrs[nb_pointers] - (char*) indexed->start))
+          failed = 1;
+        if(walked_ptrs[nb_pointers] != NULL)
+          nb_pointers++;
+      }
+      else{
+        int index = (seed >> 4) % nb_pointers;
+        heap_free(walked, walked_ptrs[index]);
+        heap_free(indexed, indexed_ptrs[index]);
+        walked_ptrs[index] = walked_ptrs[--nb_pointers];
+        indexed_ptrs[index] = indexed_ptrs[nb_pointers];
+      }
+      if(i % 100 == 0 && heap_check(indexed, HEAP_CHECK_DEEP) != HEAP_OK)
+        failed = 1;
+    }
+    if(!failed && heap_check(indexed, HEAP_CHECK_DEEP) == HEAP_OK){}
+    else{
+      printf("side table search for algorithm %d test failed\n", a);
+    }
+    heap_destroy(indexed);
+    heap_destroy(walked);
+  }
+}
+
+/* case: side table built from h_1, first fit request of 55B gets the 2nd
+ *       block (64B, f) as without the table
+ */
+void test_side_table_case_1(heap **h_0, heap **h_1, heap **h_2){
+  void* payload = NULL;
+  if(heap_enable_side_table(*h_1) == 0)
+    payload = heap_malloc(*h_1, 63 - 2 * HEADER_SIZE);
+  if(payload != NULL
+      && wrapper_get_block_start(payload) == wrapper_get_next_block(wrapper_get_next_block((*h_1)->start))
+      && wrapper_get_block_size(wrapper_get_block_start(payload)) == 64
+      && heap_check(*h_1, HEAP_CHECK_FAST) == HEAP_OK){}
+  else{
+    printf("side table first fit from h_1 requests 55B failed\n");
+  }
+  heap_disable_side_table(*h_1);
+}
+
+/* case: shrinking a 512B block to 100B splits off the rest in place,
+ *       and growing it back into the free space stays in place
+ */
+void test_heap_realloc_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1024, HEAP_FIRSTFIT);
+  char* payload = heap_malloc(h, 500);
+  char* end = heap_malloc(h, 100);
+  memset(payload, 'a', 500);
+  char* shrunk = heap_realloc(h, payload, 100);
+  block_size_t shrunk_size = wrapper_get_block_size(wrapper_get_block_start(shrunk));
+  char* grown = heap_realloc(h, shrunk, 300);
+
+  if(end != NULL
+      && shrunk == payload
+      && shrunk_size == wrapper_get_size_to_allocate(100)
+      && grown == payload
+      && grown[99] == 'a'
+      && heap_usable_size(h, grown) >= 300
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK){}
+  else{
+    printf("realloc in place test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: growing a block followed by a block in use moves it, keeping its
+ *       contents, and frees the old block
+ */
+void test_heap_realloc_case_1(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1024, HEAP_BESTFIT);
+  char* payload = heap_malloc(h, 64);
+  heap_malloc(h, 64);
+  memset(payload, 'b', 64);
+  char* moved = heap_realloc(h, payload, 200);
+
+  if(moved != NULL
+      && moved != payload
+      && moved[0] == 'b' && moved[63] == 'b'
+      && !wrapper_block_is_in_use(wrapper_get_block_start(payload))
+      && heap_realloc(h, NULL, 10) != NULL
+      && heap_realloc(h, moved, 0) == NULL
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK){}
+  else{
+    printf("realloc by moving test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: aligned mallocs return aligned payloads, the space in front is
+ *       freed, and freeing everything leaves a single free block
+ */
+void test_heap_malloc_aligned_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(16384, HEAP_FIRSTFIT);
+  heap_malloc(h, 8);
+  void* a = heap_malloc_aligned(h, 64, 100);
+  void* b = heap_malloc_aligned(h, 4096, 10);
+  void* c = heap_malloc_aligned(h, 8, 10);
+  int aligned = a != NULL && b != NULL && c != NULL
+    && (uintptr_t) a % 64 == 0 && (uintptr_t) b % 4096 == 0
+    && heap_usable_size(h, b) >= 10
+    && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK;
+
+  heap_free(h, a);
+  heap_free(h, b);
+  heap_free(h, c);
+  if(aligned
+      && heap_malloc_aligned(h, 24, 10) == NULL
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK){}
+  else{
+    printf("aligned malloc test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: blocks of a persistent heap survive closing and reopening it,
+ *       and are found again by their offsets
+ */
+void test_heap_open_case_0(heap **h_0, heap **h_1, heap **h_2){
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/implicit-test-%d.heap", (int) getpid());
+  unlink(path);
+
+  heap* h = heap_open(path, 4096, HEAP_NEXTFIT);
+  char* a = h ? heap_malloc(h, 100) : NULL;
+  char* b = h ? heap_malloc(h, 200) : NULL;
+  char* c = h ? heap_malloc(h, 300) : NULL;
+  if(h == NULL || a == NULL || b == NULL || c == NULL){
+    printf("open new persistent heap test failed\n");
+    unlink(path);
+    return;
+  }
+  strcpy(a, "first");
+  strcpy(c, "third");
+  heap_free(h, b);
+  intptr_t a_off = a - (char*) h->start;
+  intptr_t c_off = c - (char*) h->start;
+  intptr_t next_off = h->next - h->start;
+  block_size_t avg = heap_find_avg_free_block_size(h);
+
+  if(heap_close(h) == 0
+      && (h = heap_open(path, 0, HEAP_NEXTFIT)) != NULL
+      && strcmp((char*) h->start + a_off, "first") == 0
+      && strcmp((char*) h->start + c_off, "third") == 0
+      && h->next - h->start == next_off
+      && heap_find_avg_free_block_size(h) == avg
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK){}
+  else{
+    printf("reopen persistent heap test failed\n");
+  }
+  if(h != NULL){
+    heap_free(h, (char*) h->start + a_off);
+    heap_free(h, (char*) h->start + c_off);
+    if(heap_find_avg_free_block_size(h) == h->size){}
+    else{
+      printf("free blocks of reopened persistent heap test failed\n");
+    }
+    heap_close(h);
+  }
+  unlink(path);
+}
+
+/* case: a file that is not a heap, or a heap that is already open, is
+ *       rejected; a heap left open by a crashed process is validated on
+ *       reopening, and rejected if its blocks are corrupted
+ */
+void test_heap_open_case_1(heap **h_0, heap **h_1, heap **h_2){
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/implicit-test-%d.heap", (int) getpid());
+  unlink(path);
+
+  FILE* f = fopen(path, "w");
+  fprintf(f, "this is not a heap, but it is long enough to hold a header\n");
+  fclose(f);
+  if(heap_open(path, 4096, HEAP_FIRSTFIT) == NULL){}
+  else{
+    printf("open persistent heap from foreign file test failed\n");
+  }
+  unlink(path);
+
+  heap* h = heap_open(path, 4096, HEAP_FIRSTFIT);
+  if(h != NULL && heap_open(path, 4096, HEAP_FIRSTFIT) == NULL){}
+  else{
+    printf("open persistent heap twice test failed\n");
+  }
+  if(h != NULL)
+    heap_close(h);
+
+  int corrupt;
+  for(corrupt = 0; corrupt < 2; corrupt++){
+    pid_t pid = fork();
+    if(pid == 0){
+      h = heap_open(path, 4096, HEAP_FIRSTFIT);
+      void* payload = h ? heap_malloc(h, 64) : NULL;
+      if(payload != NULL && corrupt)
+        *((block_size_t*) wrapper_get_block_start(payload)) = 3;
+      _exit(0); /* without heap_close */
+    }
+    waitpid(pid, NULL, 0);
+    h = heap_open(path, 4096, HEAP_FIRSTFIT);
+    if(corrupt ? h == NULL
+        : h != NULL && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK
+          && heap_find_avg_free_block_size(h) < h->size){}
+    else{
+      printf("reopen persistent heap after crash test failed\n");
+    }
+    if(h != NULL)
+      heap_close(h);
+  }
+  unlink(path);
+}
+
+/* case: a block allocated by one process in a shared heap is read and
+ *       freed by another, through its offset
+ */
+void test_shared_heap_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create_shared(1 << 16, HEAP_FIRSTFIT);
+  int fds[2];
+  intptr_t offset = -1;
+  if(h == NULL || pipe(fds) < 0){
+    printf("create shared heap test failed\n");
+    return;
+  }
+
+  pid_t pid = fork();
+  if(pid == 0){
+    heap* mine = heap_attach_shared(heap_shared_fd(h), HEAP_BESTFIT);
+    char* buf = mine ? heap_malloc(mine, 1000) : NULL;
+    if(buf != NULL){
+      strcpy(buf, "handed over");
+      offset = heap_offset(mine, buf);
+    }
+    if(write(fds[1], &offset, sizeof(offset)) != sizeof(offset)){}
+    _exit(0);
+  }
+  if(read(fds[0], &offset, sizeof(offset)) != sizeof(offset))
+    offset = -1;
+  waitpid(pid, NULL, 0);
+  close(fds[0]);
+  close(fds[1]);
+
+  char* buf = heap_pointer(h, offset);
+  if(buf != NULL
+      && strcmp(buf, "handed over") == 0
+      && heap_free(h, buf) == HEAP_OK
+      && heap_find_avg_free_block_size(h) == h->size
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK){}
+  else{
+    printf("hand over block between processes test failed\n");
+  }
+  heap_close(h);
+}
+
+/* case: several processes allocating and freeing in a shared heap at the
+ *       same time leave it consistent
+ */
+void test_shared_heap_case_1(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create_shared(1 << 20, HEAP_NEXTFIT);
+  pid_t pids[4];
+  int i, j, failed = 0;
+  if(h == NULL){
+    printf("create shared heap test failed\n");
+    return;
+  }
+
+  for(i = 0; i < 4; i++){
+    pids[i] = fork();
+    if(pids[i] == 0){
+      void* blocks[32] = { NULL };
+      unsigned seed = i + 1;
+      int k;
+      for(j = 0; j < 20000; j++){
+        k = rand_r(&seed) % 32;
+        if(blocks[k] != NULL){
+          if(((char*) blocks[k])[0] != (char) k)
+            _exit(1);
+          heap_free(h, blocks[k]);
+          blocks[k] = NULL;
+        }
+        else if((blocks[k] = heap_malloc(h, 1 + rand_r(&seed) % 2000)) != NULL){
+          ((char*) blocks[k])[0] = (char) k;
+        }
+      }
+      for(k = 0; k < 32; k++)
+        heap_free(h, blocks[k]);
+      _exit(0);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    int status;
+    waitpid(pids[i], &status, 0);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed = 1;
+  }
+
+  if(!failed
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK
+      && heap_find_avg_free_block_size(h) == h->size
+      && heap_enable_side_table(h) < 0){}
+  else{
+    printf("concurrent shared heap test failed\n");
+  }
+  heap_close(h);
+}
+
+/*
+ * Blocks freed by one consumer thread in test_heap_free_remote_case_0.
+ */
+typedef struct remote_free_job {
+  heap* h;
+  void** blocks;
+  int count;
+} remote_free_job;
+
+static void* remote_free_worker(void* arg){
+  remote_free_job* job = arg;
+  int i;
+  for(i = 0; i < job->count; i++)
+    heap_free_remote(job->h, job->blocks[i]);
+  return NULL;
+}
+
+/* case: blocks freed by consumer threads while the owner keeps
+ *       allocating are all reclaimed, and the heap stays consistent
+ */
+void test_heap_free_remote_case_0(heap **h_0, heap **h_1, heap **h_2){
+  enum { THREADS = 4, PER_THREAD = 500 };
+  heap* h = heap_create(1 << 20, HEAP_FIRSTFIT);
+  static void* blocks[THREADS * PER_THREAD];
+  remote_free_job jobs[THREADS];
+  pthread_t threads[THREADS];
+  int i, failed = 0;
+
+  for(i = 0; i < THREADS * PER_THREAD; i++)
+    if((blocks[i] = heap_malloc(h, 16 + i % 200)) == NULL)
+      failed = 1;
+  for(i = 0; i < THREADS; i++){
+    jobs[i] = (remote_free_job) { h, blocks + i * PER_THREAD, PER_THREAD };
+    pthread_create(&threads[i], NULL, remote_free_worker, &jobs[i]);
+  }
+  for(i = 0; i < 2000; i++){
+    void* payload = heap_malloc(h, 64);
+    if(payload == NULL)
+      failed = 1;
+    heap_free(h, payload);
+  }
+  for(i = 0; i < THREADS; i++)
+    pthread_join(threads[i], NULL);
+  heap_drain_remote_frees(h);
+
+  if(!failed
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK
+      && heap_find_avg_free_block_size(h) == h->size){}
+  else{
+    printf("free blocks from other threads test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/*
+ * Work done by each thread of test_heap_arenas_case_0.
+ */
+static void* arena_worker(void* arg){
+  heap_arenas* a = arg;
+  int i;
+  for(i = 0; i < 2000; i++){
+    void* payload = heap_malloc(heap_arenas_select(a), 1 + i % 300);
+    if(payload == NULL)
+      return "malloc";
+    /* the thread may have moved to another node in between */
+    if(heap_free(heap_arenas_owner(a, payload), payload) != HEAP_OK)
+      return "free";
+  }
+  return NULL;
+}
+
+/* case: a heap bound to a node, including one that does not exist, is
+ *       usable, and threads allocating from per-node arenas leave every
+ *       arena consistent
+ */
+void test_heap_arenas_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create_on_node(4096, HEAP_FIRSTFIT, 0);
+  heap* far = heap_create_on_node(4096, HEAP_FIRSTFIT, 999);
+  if(h != NULL && far != NULL
+      && heap_malloc(h, 100) != NULL && heap_malloc(far, 100) != NULL
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK
+      && heap_check(far, HEAP_CHECK_DEEP) == HEAP_OK){}
+  else{
+    printf("create heap on NUMA node test failed\n");
+  }
+
+  heap_arenas* a = heap_arenas_create(1 << 18, HEAP_BESTFIT);
+  pthread_t threads[4];
+  void* result;
+  int i, failed = a == NULL;
+  for(i = 0; !failed && i < 4; i++)
+    pthread_create(&threads[i], NULL, arena_worker, a);
+  for(i = 0; !failed && i < 4; i++){
+    pthread_join(threads[i], &result);
+    if(result != NULL)
+      failed = 1;
+  }
+  if(!failed
+      && heap_check(heap_arenas_select(a), HEAP_CHECK_DEEP) == HEAP_OK
+      && heap_find_avg_free_block_size(heap_arenas_select(a)) == heap_arenas_select(a)->size){}
+  else{
+    printf("NUMA arenas test failed\n");
+  }
+  if(a != NULL)
+    heap_arenas_destroy(a);
+  heap_destroy(far);
+  heap_destroy(h);
+}
+
+/*
+ * Heap shared by the threads of test_heap_set_thread_safe_case_0, and
+ * the number of them that finished.
+ */
+typedef struct locked_job {
+  heap* h;
+  int done;
+} locked_job;
+
+/*
+ * Work done by each thread of test_heap_set_thread_safe_case_0.
+ */
+static void* locked_worker(void* arg){
+  locked_job* job = arg;
+  void* blocks[16] = { NULL };
+  char* result = NULL;
+  int i;
+  for(i = 0; i < 20000 && result == NULL; i++){
+    if(blocks[i % 16] != NULL && heap_free(job->h, blocks[i % 16]) != HEAP_OK)
+      result = "free";
+    blocks[i % 16] = heap_malloc(job->h, 1 + i % 500);
+    if(blocks[i % 16] == NULL)
+      result = "malloc";
+  }
+  for(i = 0; i < 16; i++)
+    heap_free(job->h, blocks[i]);
+  __atomic_fetch_add(&job->done, 1, __ATOMIC_RELEASE);
+  return result;
+}
+
+/* case: switching the side table and the hardening options of a
+ *       thread-safe heap while other threads malloc and free leaves it
+ *       consistent
+ */
+void test_heap_set_thread_safe_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create_on_node(1 << 20, HEAP_FIRSTFIT, -1);
+  locked_job job = { h, 0 };
+  pthread_t threads[4];
+  void* result;
+  int i, nb_threads = 0, failed = h == NULL || heap_set_thread_safe(h) != 0;
+
+  for(; !failed && nb_threads < 4; nb_threads++)
+    pthread_create(&threads[nb_threads], NULL, locked_worker, &job);
+  for(i = 0; __atomic_load_n(&job.done, __ATOMIC_ACQUIRE) < nb_threads; i++){
+    if(i % 2 == 0){
+      heap_enable_side_table(h);
+      heap_set_hardening(h, HEAP_HARDEN_FREE | HEAP_HARDEN_QUARANTINE);
+    }
+    else{
+      heap_disable_side_table(h);
+      heap_set_hardening(h, 0);
+    }
+  }
+  for(i = 0; i < nb_threads; i++){
+    pthread_join(threads[i], &result);
+    if(result != NULL)
+      failed = 1;
+  }
+  if(!failed && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK
+     && heap_find_avg_free_block_size(h) == h->size){}
+  else{
+    printf("change options of a thread-safe heap test failed\n");
+  }
+  if(h != NULL)
+    heap_destroy(h);
+}
+
+/* case: a heap backed by huge pages keeps the requested size and
+ *       behaves like any other heap
+ */
+void test_heap_create_huge_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create_huge(1 << 20, HEAP_BESTFIT);
+  heap* plain = heap_create(1 << 20, HEAP_BESTFIT);
+  void* payload = h ? heap_malloc(h, 5000) : NULL;
+  if(h != NULL && payload != NULL
+      && (uintptr_t) payload % PAYLOAD_ALIGN == 0
+      && h->size >= plain->size - PAYLOAD_ALIGN && h->size <= plain->size + PAYLOAD_ALIGN
+      && heap_free(h, payload) == HEAP_OK
+      && heap_find_avg_free_block_size(h) == h->size
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK){}
+  else{
+    printf("create heap backed by huge pages test failed\n");
+  }
+  heap_destroy(plain);
+  heap_destroy(h);
+}
+
+/* case: a guarded heap keeps its header on cache-aligned pages apart from
+ *       the blocks, behaves like any other heap, and faults on a write
+ *       just past the end of its block area (at the first byte aligned
+ *       like payloads, which is the end itself with 8-byte tags)
+ */
+void test_heap_create_guarded_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create_guarded(1 << 16, HEAP_FIRSTFIT);
+  heap* plain = heap_create(1 << 16, HEAP_FIRSTFIT);
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  void* payload = h ? heap_malloc(h, 5000) : NULL;
+  int status = 0;
+
+  if(h != NULL && payload != NULL
+      && (uintptr_t) h % 64 == 0
+      && ((uintptr_t) h->start & -page) - ((uintptr_t) h & -page) >= 2 * page
+      && h->size >= plain->size - 2 * PAYLOAD_ALIGN && h->size <= plain->size + 2 * PAYLOAD_ALIGN
+      && heap_free(h, payload) == HEAP_OK
+      && heap_find_avg_free_block_size(h) == h->size
+      && heap_check(h, HEAP_CHECK_DEEP) == HEAP_OK){
+    pid_t pid = fork();
+    if(pid == 0){
+      char* end = (char*) h->start + h->size;
+      end += -(uintptr_t) end & (PAYLOAD_ALIGN - 1);
+      *end = 1;
+      _exit(0);
+    }
+    waitpid(pid, &status, 0);
+  }
+  if(WIFSIGNALED(status)){}
+  else{
+    printf("create guarded heap test failed\n");
+  }
+  heap_destroy(plain);
+  if(h != NULL)
+    heap_destroy(h);
+}
+
+/* case: searches that skip allocated runs through walk hints still
+ *       find every hole in address order
+ */
+void test_walk_hints_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1 << 16, HEAP_FIRSTFIT);
+  void* blocks[800];
+  int i, failed = 0;
+
+  for(i = 0; i < 800; i++)
+    blocks[i] = heap_malloc(h, 64);
+  for(i = 0; i < 800; i += 20)
+    heap_free(h, blocks[i]);
+  for(i = 0; i < 3; i++){
+    /* fits nowhere, so walks the whole heap and records hints in every hole */
+    if(heap_malloc(h, 1 << 15) != NULL || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+      failed = 1;
+  }
+  /* a block freed inside a skipped run must be found again */
+  heap_free(h, blocks[10]);
+  if(heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  for(i = 0; i < 800; i += 20){
+    if(heap_malloc(h, 64) != blocks[i] || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+      failed = 1;
+    if(i == 0 && heap_malloc(h, 64) != blocks[10])
+      failed = 1;
+  }
+  if(!failed){}
+  else{
+    printf("skip allocated blocks with walk hints test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: segregated next fit serves small requests from the holes its small
+ *       rover was sent back to, even after a large request moved on
+ */
+void test_seg_next_fit_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1 << 16, HEAP_SEGNEXTFIT);
+  void* small[10];
+  int i, failed = 0;
+
+  for(i = 0; i < 10; i++)
+    small[i] = heap_malloc(h, 24);
+  heap_free(h, small[2]);
+  heap_free(h, small[5]);
+  if(heap_malloc(h, 2000) < small[9])
+    failed = 1;
+  if(heap_malloc(h, 24) != small[2] || heap_malloc(h, 24) != small[5])
+    failed = 1;
+  if(heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("segregated next fit, small requests after a large one test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: random mallocs, frees, reallocs and aligned mallocs on a segregated
+ *       next fit heap keep every rover at a block boundary
+ */
+void test_seg_next_fit_case_1(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1 << 16, HEAP_SEGNEXTFIT);
+  void* ptrs[64];
+  void* moved;
+  int nb_pointers = 0, i, failed = 0;
+  unsigned int seed = 261;
+
+  for(i = 0; i < 4000 && !failed; i++){
+    seed = seed * 1103515245 + 12345;
+    block_size_t size = (seed >> 8) % 3000 + 1;
+    int index = nb_pointers ? (seed >> 4) % nb_pointers : 0;
+    switch(nb_pointers == 0 ? 0 : (seed >> 16) % 4){
+    case 0:
+      if(nb_pointers < 64 && (ptrs[nb_pointers] = heap_malloc(h, size)) != NULL)
+        nb_pointers++;
+      break;
+    case 1:
+      if(nb_pointers < 64 && (ptrs[nb_pointers] = heap_malloc_aligned(h, 64, size)) != NULL)
+        nb_pointers++;
+      break;
+    case 2:
+      if((moved = heap_realloc(h, ptrs[index], size)) != NULL)
+        ptrs[index] = moved;
+      break;
+    default:
+      heap_free(h, ptrs[index]);
+      ptrs[index] = ptrs[--nb_pointers];
+    }
+    if(heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+      failed = 1;
+  }
+  if(!failed){}
+  else{
+    printf("segregated next fit rovers under random operations test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: a heap with a higher split threshold hands out a free block whole
+ *       when the unused part is below the threshold, and counts the waste
+ */
+void test_heap_tuning_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1 << 16, HEAP_FIRSTFIT);
+  heap_tuning tuning;
+  heap_split_stats before, after;
+  void* p;
+  void* q;
+  int failed = 0;
+
+  heap_get_tuning(h, &tuning);
+  if(tuning.split_threshold != MAX_UNUSED_BYTES || tuning.adaptive)
+    failed = 1;
+  p = heap_malloc(h, 600);
+  heap_malloc(h, 8);
+  heap_free(h, p);
+
+  tuning.split_threshold = 1024;
+  if(heap_set_tuning(h, &tuning) != 0)
+    failed = 1;
+  heap_get_split_stats(h, &before);
+  q = heap_malloc(h, 300);
+  heap_get_split_stats(h, &after);
+  if(q != p || heap_usable_size(h, q) < 600 || after.splits != before.splits
+     || after.waste - before.waste != 296 || after.allocs - before.allocs != 1)
+    failed = 1;
+  heap_free(h, q);
+
+  tuning.split_threshold = MAX_UNUSED_BYTES;
+  heap_set_tuning(h, &tuning);
+  q = heap_malloc(h, 300);
+  heap_get_split_stats(h, &after);
+  if(q != p || heap_usable_size(h, q) >= 600 || after.splits != before.splits + 1)
+    failed = 1;
+
+  tuning.split_threshold = 2;
+  if(heap_set_tuning(h, &tuning) != -1 || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("per-heap split threshold test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: the adaptive split policy doubles the threshold while blocks split
+ *       and coalesce without waste, and halves it while blocks waste space
+ */
+void test_heap_tuning_case_1(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1 << 16, HEAP_FIRSTFIT);
+  heap_tuning tuning = { MAX_UNUSED_BYTES, 1, 10 };
+  void* p;
+  int i, failed = 0;
+
+  /* a 1008-byte hole, of which 600-byte requests leave 400 bytes */
+  p = heap_malloc(h, 1000);
+  heap_malloc(h, 8);
+  heap_free(h, p);
+
+  heap_set_tuning(h, &tuning);
+  for(i = 0; i < HEAP_SPLIT_ADAPT_INTERVAL; i++)
+    heap_free(h, heap_malloc(h, 600));
+  heap_get_tuning(h, &tuning);
+  if(tuning.split_threshold != 2 * MAX_UNUSED_BYTES)
+    failed = 1;
+
+  tuning.split_threshold = 4096;
+  heap_set_tuning(h, &tuning);
+  for(i = 0; i < HEAP_SPLIT_ADAPT_INTERVAL; i++)
+    heap_free(h, heap_malloc(h, 600));
+  heap_get_tuning(h, &tuning);
+  if(tuning.split_threshold != 2048 || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("adaptive split threshold test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: resetting a heap with blocks in use, a quarantined block and a
+ *       side table leaves a single free block that serves the next malloc
+ */
+void test_heap_reset_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1 << 16, HEAP_SEGNEXTFIT);
+  void* first;
+  int i, failed = heap_enable_side_table(h) != 0;
+
+  heap_set_hardening(h, HEAP_HARDEN_FREE | HEAP_HARDEN_QUARANTINE);
+  first = heap_malloc(h, 100);
+  for(i = 0; i < 50; i++)
+    heap_malloc(h, 10 * i + 1);
+  heap_free(h, first);
+  if(heap_reset(h) != 0
+     || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK
+     || heap_find_avg_free_block_size(h) != h->size
+     || heap_malloc(h, 3000) != first
+     || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("reset heap to a single free block test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: destroying heaps returns their memory to the system once nothing
+ *       above it is in use, a heap created meanwhile reuses a destroyed
+ *       heap's memory, and persistent heaps are left to heap_close
+ */
+void test_heap_destroy_case_0(heap **h_0, heap **h_1, heap **h_2){
+  char path[64];
+  void* brk = sbrk(0);
+  heap* below = heap_create(8192, HEAP_FIRSTFIT);
+  heap* above = heap_create(4096, HEAP_FIRSTFIT);
+  heap* reused;
+  heap* mapped = heap_create_on_node(4096, HEAP_FIRSTFIT, -1);
+  heap* persistent;
+  int failed = 0;
+
+  if(heap_destroy(below) != 0 || sbrk(0) == brk)
+    failed = 1;
+  reused = heap_create(4096, HEAP_BESTFIT);
+  if(reused == NULL || (void*) reused > (void*) above
+     || heap_malloc(reused, 1000) == NULL || heap_check(reused, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  heap_destroy(above);
+  heap_destroy(reused);
+  if(sbrk(0) != brk)
+    failed = 1;
+
+  if(mapped == NULL || heap_set_thread_safe(mapped) != 0
+     || heap_enable_side_table(mapped) != 0 || heap_destroy(mapped) != 0)
+    failed = 1;
+
+  snprintf(path, sizeof(path), "/tmp/implicit-test-%d.heap", (int) getpid());
+  unlink(path);
+  persistent = heap_open(path, 4096, HEAP_FIRSTFIT);
+  if(persistent == NULL || heap_destroy(persistent) != -1 || heap_close(persistent) != 0)
+    failed = 1;
+  unlink(path);
+  if(!failed){}
+  else{
+    printf("destroy heaps test failed\n");
+  }
+}
+
+/* case: long-lived blocks are carved from the top of the heap and short-lived
+ *       ones from the bottom, so freeing the short-lived ones leaves a single
+ *       hole, with and without a side table and hardening
+ */
+void test_heap_malloc_hint_case_0(heap **h_0, heap **h_1, heap **h_2){
+  int failed = 0;
+  int config, i;
+
+  for(config = 0; config < 3; config++){
+    heap* h = heap_create(1 << 16, config == 2 ? HEAP_SEGNEXTFIT : HEAP_FIRSTFIT);
+    void* longs[20];
+    void* shorts[20];
+    if(config == 1 && heap_enable_side_table(h) != 0)
+      failed = 1;
+    if(config == 2)
+      heap_set_hardening(h, HEAP_HARDEN_ALL);
+
+    for(i = 0; i < 20; i++){
+      shorts[i] = heap_malloc_hint(h, 100 + i, HEAP_HINT_SHORT);
+      longs[i] = heap_malloc_hint(h, 200 + i, HEAP_HINT_LONG);
+      if(shorts[i] == NULL || longs[i] == NULL
+	 || (i > 0 && (shorts[i] < shorts[i - 1] || longs[i] > longs[i - 1])))
+	failed = 1;
+    }
+    if((char*) longs[0] + 300 < (char*) h->start + h->size - 300
+       || (char*) shorts[0] > (char*) h->start + 300)
+      failed = 1;
+    for(i = 0; i < 20; i++)
+      heap_free(h, shorts[i]);
+    if(heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK
+       || (config != 2 && heap_find_avg_free_block_size(h) < (block_size_t) (h->size - 20 * 256)))
+      failed = 1;
+    for(i = 0; i < 20; i++)
+      heap_free(h, longs[i]);
+    heap_destroy(h);
+  }
+
+  if(!failed){}
+  else{
+    printf("malloc with lifetime hints test failed\n");
+  }
+}
+
+/* case: with a maintenance thread, heap_free only queues blocks, the thread
+ *       frees and coalesces them, and a malloc that fails without the
+ *       queued blocks frees them itself
+ */
+void test_heap_maintenance_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1 << 16, HEAP_FIRSTFIT);
+  heap_maintenance opts = { 1, 0 };
+  void* blocks[64];
+  int i, n, failed = heap_start_maintenance(h, &opts) != 0;
+
+  if(heap_start_maintenance(h, &opts) == 0)
+    failed = 1;
+  for(n = 0; n < 64 && (blocks[n] = heap_malloc(h, 2000)) != NULL; n++)
+    ;
+  for(i = 0; i < n; i++)
+    heap_free(h, blocks[i]);
+  if(heap_malloc(h, h->size / 2) == NULL)
+    failed = 1;
+  for(i = 0; i < 2000 && heap_find_avg_free_block_size(h) < h->size / 2 - 16; i++)
+    usleep(1000);
+  if(i == 2000 || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  heap_stop_maintenance(h);
+  heap_free(h, heap_malloc(h, 8));
+  if(heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("background maintenance test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: trimming releases the pages inside large free blocks, and leaves
+ *       the heap consistent and usable
+ */
+void test_heap_maintenance_case_1(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create_on_node(1 << 22, HEAP_FIRSTFIT, -1);
+  heap_maintenance opts = { 1, 1 << 16 };
+  void* small = heap_malloc(h, 100);
+  void* big = heap_malloc(h, 1 << 20);
+  int failed = small == NULL || big == NULL;
+
+  memset(big, 1, 1 << 20);
+  heap_free(h, big);
+  if(heap_trim(h, 1 << 16) < (1 << 22) - 3 * 4096
+     || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK
+     || heap_malloc(h, 1 << 21) == NULL)
+    failed = 1;
+  if(heap_start_maintenance(h, &opts) != 0)
+    failed = 1;
+  heap_free(h, small);
+  usleep(5000);
+  if(heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("trim free blocks test failed\n");
+  }
+  heap_destroy(h); // stops the maintenance thread
+}
+
+/*
+ * Allocate, fill and check large blocks while another thread trims the
+ * heap. Counts the blocks whose contents changed and the failed mallocs.
+ */
+typedef struct trim_job {
+  heap* h;
+  int corrupted;
+  int done;
+} trim_job;
+
+static void* trim_writer(void* arg){
+  trim_job* job = arg;
+  size_t size = 1 << 22, j;
+  int i;
+  for(i = 0; i < 100; i++){
+    unsigned char* p = heap_malloc(job->h, size);
+    if(p == NULL){
+      job->corrupted++;
+      continue;
+    }
+    memset(p, 0x5a, size);
+    usleep(1000);
+    for(j = 0; j < size; j += 4096)
+      if(p[j] != 0x5a){
+	job->corrupted++;
+	break;
+      }
+    heap_free(job->h, p);
+    sched_yield();
+  }
+  __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* case: trimming more free blocks than one batch releases all of them, and
+ *       trims running while the lock is dropped neither release the pages
+ *       of blocks another thread allocates nor make its mallocs fail
+ */
+void test_heap_maintenance_case_2(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create_on_node(1 << 24, HEAP_FIRSTFIT, -1);
+  void* big[40];
+  pthread_t thread;
+  trim_job job = { h, 0, 0 };
+  size_t trimmed;
+  int i, failed = h == NULL || heap_set_thread_safe(h) != 0;
+
+  for(i = 0; !failed && i < 40; i++){
+    big[i] = heap_malloc(h, 1 << 16);
+    heap_malloc(h, 100); // keeps the big blocks apart once freed
+    if(big[i] == NULL)
+      failed = 1;
+    else
+      memset(big[i], 1, 1 << 16);
+  }
+  for(i = 0; !failed && i < 40; i++)
+    heap_free(h, big[i]);
+  trimmed = failed ? 0 : heap_trim(h, 1 << 15);
+  if(trimmed < 40 * ((1 << 16) - 2 * 4096) || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+
+  if(!failed && pthread_create(&thread, NULL, trim_writer, &job) == 0){
+    while(!__atomic_load_n(&job.done, __ATOMIC_ACQUIRE))
+      heap_trim(h, 1 << 15);
+    pthread_join(thread, NULL);
+  }
+  else
+    failed = 1;
+  if(job.corrupted != 0 || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("batched trim test failed\n");
+  }
+  if(h != NULL)
+    heap_destroy(h);
+}
+
+/*
+ * Count the resident pages of [p, p + len).
+ */
+static size_t resident_pages(void* p, size_t len){
+  size_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t) p & -page;
+  size_t n = ((uintptr_t) p + len - start + page - 1) / page;
+  unsigned char* vec = malloc(n);
+  size_t i, count = 0;
+  if(vec == NULL || mincore((void*) start, n * page, vec) != 0)
+    count = n;
+  else
+    for(i = 0; i < n; i++)
+      count += vec[i] & 1;
+  free(vec);
+  return count;
+}
+
+/* case: calloc returns zeroed memory, without touching blocks that are still
+ *       zero from the system or from a trim, and clears reused blocks
+ */
+void test_heap_calloc_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create_on_node(1 << 24, HEAP_FIRSTFIT, -1);
+  size_t big = 1 << 22;
+  char* p;
+  size_t i;
+  int failed = 0;
+
+  p = heap_calloc(h, big / 8, 8);
+  if(p == NULL || resident_pages(p, big) > 2)
+    failed = 1;
+  for(i = 0; p != NULL && i < big; i += 4096)
+    if(p[i] != 0)
+      failed = 1;
+  heap_free(h, p);
+
+  p = heap_calloc(h, 100, 10);
+  if(p == NULL)
+    failed = 1;
+  memset(p, 0xff, 1000);
+  heap_free(h, p);
+  p = heap_calloc(h, 1000, 1);
+  for(i = 0; p != NULL && i < 1000; i++)
+    if(p[i] != 0)
+      failed = 1;
+  heap_free(h, p);
+
+  p = heap_malloc(h, big);
+  memset(p, 0xff, big);
+  heap_free(h, p);
+  if(heap_trim(h, 1 << 16) == 0 || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  p = heap_calloc(h, 1, big);
+  if(p == NULL || resident_pages(p, big) > 2 || p[0] != 0 || p[big - 1] != 0)
+    failed = 1;
+  if(heap_calloc(h, (size_t) -1, 2) != NULL)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("calloc of known zero blocks test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* case: sized frees free and coalesce like heap_free, and hardened heaps
+ *       reject sizes the block cannot have been allocated for, keeping it
+ */
+void test_heap_free_sized_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1 << 16, HEAP_FIRSTFIT);
+  heap* hardened = heap_create(1 << 16, HEAP_FIRSTFIT);
+  void* blocks[32];
+  void* p;
+  heap_tuning tuning;
+  int i, failed = 0;
+
+  for(i = 0; i < 32; i++)
+    blocks[i] = heap_malloc(h, 10 * i + 1);
+  for(i = 0; i < 32; i += 2)
+    if(heap_free_sized(h, blocks[i], 10 * i + 1) != HEAP_OK)
+      failed = 1;
+  for(i = 1; i < 32; i += 2)
+    if(heap_free_sized(h, blocks[i], 10 * i + 1) != HEAP_OK)
+      failed = 1;
+  if(heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK
+     || heap_find_avg_free_block_size(h) != h->size)
+    failed = 1;
+
+  heap_set_hardening(hardened, HEAP_HARDEN_ALL);
+  p = heap_malloc(hardened, 1000);
+  if(heap_free_sized(hardened, p, 2000) != HEAP_ERR_FREE_SIZE
+     || heap_free_sized(hardened, p, 10) != HEAP_ERR_FREE_SIZE
+     || heap_free_sized(hardened, p, 700) != HEAP_ERR_FREE_SIZE
+     || heap_check(hardened, HEAP_CHECK_DEEP) != HEAP_OK
+     || heap_free_sized(hardened, p, 1000) != HEAP_OK
+     || heap_free_sized(hardened, p, 1000) != HEAP_ERR_DOUBLE_FREE)
+    failed = 1;
+  // a block handed out whole, with room to spare, takes its request size
+  p = heap_malloc(hardened, 200);
+  heap_free(hardened, heap_malloc(hardened, 8)); // keep the next block in use
+  if(p == NULL || heap_free_sized(hardened, p, 190) != HEAP_OK)
+    failed = 1;
+  // a larger split threshold leaves more room in blocks handed out under it
+  heap_get_tuning(hardened, &tuning);
+  tuning.split_threshold = 1024;
+  heap_set_tuning(hardened, &tuning);
+  p = heap_malloc(hardened, 1000);
+  if(p == NULL || heap_free_sized(hardened, p, 700) != HEAP_OK)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("sized free test failed\n");
+  }
+  heap_destroy(hardened);
+  heap_destroy(h);
+}
+
+/* case: with a wilderness probe, a malloc that fits none of the first
+ *       blocks is split off the free block at the end of the heap, holes
+ *       near the start are still reused, and the wilderness grows back
+ *       when the blocks before it are freed
+ */
+void test_heap_wilderness_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1 << 16, HEAP_FIRSTFIT);
+  heap_tuning tuning;
+  void* blocks[100];
+  void* p;
+  int i, failed = 0;
+
+  heap_get_tuning(h, &tuning);
+  if(tuning.wilderness_probe != 0)
+    failed = 1;
+  tuning.wilderness_probe = 4;
+  heap_set_tuning(h, &tuning);
+  for(i = 0; i < 100; i++)
+    blocks[i] = heap_malloc(h, 64);
+  for(i = 1; i < 100; i++)
+    if((char*) blocks[i] - (char*) blocks[i - 1] != (char*) blocks[1] - (char*) blocks[0])
+      failed = 1;
+
+  // a hole beyond the probe is passed over for the wilderness
+  heap_free(h, blocks[50]);
+  p = heap_malloc(h, 64);
+  if(p <= blocks[99])
+    failed = 1;
+  heap_free(h, p);
+  // a hole within the probe is reused
+  heap_free(h, blocks[1]);
+  if(heap_malloc(h, 64) != blocks[1])
+    failed = 1;
+  // freeing the trailing blocks returns them to the wilderness
+  for(i = 60; i < 100; i++)
+    heap_free(h, blocks[i]);
+  if(heap_malloc(h, 64) != blocks[60] || heap_check(h, HEAP_CHECK_DEEP) != HEAP_OK)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("wilderness probe test failed\n");
+  }
+  heap_destroy(h);
+}
+
+/* Two call sites of heap_malloc for the profiler tests */
+static __attribute__((noinline)) void* profile_site_a(heap* h, block_size_t size){
+  void* p = heap_malloc(h, size);
+  __asm__ volatile("" ::: "memory");
+  return p;
+}
+
+static __attribute__((noinline)) void* profile_site_b(heap* h, block_size_t size){
+  void* p = heap_malloc(h, size);
+  __asm__ volatile("" ::: "memory");
+  return p;
+}
+
+/* case: sampling every malloc attributes counts and bytes to each call site
+ *       and size class, follows blocks moved by realloc to their free, and
+ *       stopping the profiler drops the samples
+ */
+void test_heap_profile_case_0(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1 << 16, HEAP_FIRSTFIT);
+  heap_profile_entry entries[4];
+  void* a[10];
+  void* moved;
+  int i, failed = heap_profile_start(h, 1) != 0;
+  int fd = open("/dev/null", O_WRONLY);
+
+  for(i = 0; i < 10; i++)
+    a[i] = profile_site_a(h, 24);
+  for(i = 0; i < 5; i++)
+    profile_site_b(h, 1000);
+  // the blocks of site b follow a[9], so it cannot grow in place
+  moved = heap_realloc(h, a[9], 2000);
+  if(moved == NULL || moved == a[9]
+     || heap_profile_sites(h, entries, 4) != 2
+     || entries[0].frees != 0 || entries[1].frees != 0)
+    failed = 1;
+  a[9] = moved;
+  for(i = 0; i < 3; i++)
+    heap_free(h, a[i]);
+  heap_free(h, a[9]);
+
+  if(heap_profile_sites(h, entries, 4) != 2
+     || entries[0].allocs != 5 || entries[0].bytes != 5000
+     || entries[0].max_size != 1000 || entries[0].frees != 0
+     || entries[1].allocs != 10 || entries[1].bytes != 240
+     || entries[1].frees != 4 || entries[0].site == entries[1].site)
+    failed = 1;
+  if(heap_profile_classes(h, entries, 4) != 2
+     || entries[0].bytes != 5000 || entries[1].max_size != 24
+     || entries[1].frees != 4)
+    failed = 1;
+  if(heap_profile_report(h, fd) != 0)
+    failed = 1;
+  heap_profile_stop(h);
+  if(heap_profile_sites(h, entries, 4) != 0 || heap_profile_report(h, fd) == 0)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("profile call sites and size classes test failed\n");
+  }
+  close(fd);
+  heap_destroy(h);
+}
+
+/* case: sampling 1 in 10 mallocs on a hardened heap records about a tenth
+ *       of them, and sees every sampled block freed
+ */
+void test_heap_profile_case_1(heap **h_0, heap **h_1, heap **h_2){
+  heap* h = heap_create(1 << 16, HEAP_NEXTFIT);
+  heap_profile_entry entry;
+  int i, failed = heap_profile_start(h, 10) != 0;
+
+  heap_set_hardening(h, HEAP_HARDEN_ALL);
+  for(i = 0; i < 10000; i++)
+    heap_free(h, profile_site_a(h, 8 + i % 64));
+  if(heap_profile_sites(h, &entry, 1) != 1
+     || entry.allocs < 800 || entry.allocs > 1200
+     || entry.frees != entry.allocs || entry.max_size > 71)
+    failed = 1;
+  if(!failed){}
+  else{
+    printf("profile sampling rate test failed\n");
+  }
+  heap_destroy(h);
+}
+
 /*
  * running all unit tests
  */
 void unit_tests(){
-  heap* h_0; heap* h_1; heap* h_2;
+  heap* h_0 = NULL; heap* h_1 = NULL; heap* h_2 = NULL;
+
+  // tests: heap_create
+  test_heap_create_case_0(&h_0, &h_1, &h_2);
+
+  // tests: hardened heap_free
+  test_hardened_free_case_0(&h_0, &h_1, &h_2);
+  test_hardened_free_case_1(&h_0, &h_1, &h_2);
+  test_hardened_free_case_2(&h_0, &h_1, &h_2);
+  test_hardened_free_case_3(&h_0, &h_1, &h_2);
+
+  // tests: specialized heaps
+  test_spec_heap_case_0(&h_0, &h_1, &h_2);
+
+  // tests: heap_realloc and heap_malloc_aligned
+  test_heap_realloc_case_0(&h_0, &h_1, &h_2);
+  test_heap_realloc_case_1(&h_0, &h_1, &h_2);
+  test_heap_malloc_aligned_case_0(&h_0, &h_1, &h_2);
+
+  // tests: side table search
+  test_side_table_case_0(&h_0, &h_1, &h_2);
+
+  // tests: persistent heaps
+  test_heap_open_case_0(&h_0, &h_1, &h_2);
+  test_heap_open_case_1(&h_0, &h_1, &h_2);
+
+  // tests: shared heaps
+  test_shared_heap_case_0(&h_0, &h_1, &h_2);
+  test_shared_heap_case_1(&h_0, &h_1, &h_2);
+
+  // tests: heap_free_remote
+  test_heap_free_remote_case_0(&h_0, &h_1, &h_2);
+
+  // tests: NUMA placement
+  test_heap_arenas_case_0(&h_0, &h_1, &h_2);
+
+  // tests: heap_set_thread_safe
+  test_heap_set_thread_safe_case_0(&h_0, &h_1, &h_2);
+
+  // tests: huge pages
+  test_heap_create_huge_case_0(&h_0, &h_1, &h_2);
+
+  // tests: guarded heaps
+  test_heap_create_guarded_case_0(&h_0, &h_1, &h_2);
+
+  // tests: walk hints
+  test_walk_hints_case_0(&h_0, &h_1, &h_2);
+
+  // tests: segregated next fit
+  test_seg_next_fit_case_0(&h_0, &h_1, &h_2);
+  test_seg_next_fit_case_1(&h_0, &h_1, &h_2);
+
+  // tests: split policy tuning
+  test_heap_tuning_case_0(&h_0, &h_1, &h_2);
+  test_heap_tuning_case_1(&h_0, &h_1, &h_2);
+
+  // tests: heap_reset and heap_destroy
+  test_heap_reset_case_0(&h_0, &h_1, &h_2);
+  test_heap_destroy_case_0(&h_0, &h_1, &h_2);
+
+  // tests: sampling profiler
+  test_heap_profile_case_0(&h_0, &h_1, &h_2);
+  test_heap_profile_case_1(&h_0, &h_1, &h_2);
+
+  // tests: heap_malloc_hint
+  test_heap_malloc_hint_case_0(&h_0, &h_1, &h_2);
+
+  // tests: background maintenance and trimming
+  test_heap_maintenance_case_0(&h_0, &h_1, &h_2);
+  test_heap_maintenance_case_1(&h_0, &h_1, &h_2);
+  test_heap_maintenance_case_2(&h_0, &h_1, &h_2);
+
+  // tests: heap_calloc
+  test_heap_calloc_case_0(&h_0, &h_1, &h_2);
+
+  // tests: heap_free_sized
+  test_heap_free_sized_case_0(&h_0, &h_1, &h_2);
+
+  // tests: heap_set_tuning (wilderness probe)
+  test_heap_wilderness_case_0(&h_0, &h_1, &h_2);
 
   // tests: heap_print
   initialize_heaps(&h_0, &h_1, &h_2, HEAP_FIRSTFIT);
   heap_print(h_0);
   heap_print(h_1);
 
+  // tests: heap_snapshot
+  initialize_heaps(&h_0, &h_1, &h_2, HEAP_FIRSTFIT);
+  test_heap_snapshot_case_0(&h_0, &h_1, &h_2);
+
+  // tests: heap_check
+  initialize_heaps(&h_0, &h_1, &h_2, HEAP_FIRSTFIT);
+  test_heap_check_case_0(&h_0, &h_1, &h_2);
+  initialize_heaps(&h_0, &h_1, &h_2, HEAP_FIRSTFIT);
+  test_heap_check_case_1(&h_0, &h_1, &h_2);
+  initialize_heaps(&h_0, &h_1, &h_2, HEAP_FIRSTFIT);
+  test_heap_check_case_2(&h_0, &h_1, &h_2);
+  initialize_heaps(&h_0, &h_1, &h_2, HEAP_FIRSTFIT);
+  test_heap_check_case_3(&h_0, &h_1, &h_2);
+  initialize_heaps(&h_0, &h_1, &h_2, HEAP_NEXTFIT);
+  test_heap_check_case_4(&h_0, &h_1, &h_2);
+
   // tests: heap_find_avg_free_block_size
   initialize_heaps(&h_0, &h_1, &h_2, HEAP_FIRSTFIT);
-  if(heap_find_avg_free_block_size(h_0)==24){}
+  if(heap_find_avg_free_block_size(h_0)==24 + FIXTURE_SLACK){}
   else{
     printf("find average free block size of h_0 failed\n");
   }
@@ -499,23 +2129,23 @@ void unit_tests(){
 
   // tests: get_size_to_allocate
   initialize_heaps(&h_0, &h_1, &h_2, HEAP_FIRSTFIT);
-  if(wrapper_get_size_to_allocate(1)==16){}
+  if(wrapper_get_size_to_allocate(1)==8 + 2 * HEADER_SIZE){}
   else{
     printf("get min block size when user size is 1 failed\n");
   }
-  if(wrapper_get_size_to_allocate(7)==16){}
+  if(wrapper_get_size_to_allocate(7)==8 + 2 * HEADER_SIZE){}
   else{
     printf("get min block size when user size is 7 failed\n");
   }
-  if(wrapper_get_size_to_allocate(8)==16){}
+  if(wrapper_get_size_to_allocate(8)==8 + 2 * HEADER_SIZE){}
   else{
     printf("get min block size when user size is 8 failed\n");
   }
-  if(wrapper_get_size_to_allocate(19)==32){}
+  if(wrapper_get_size_to_allocate(19)==24 + 2 * HEADER_SIZE){}
   else{
     printf("get min block size when user size is 19 failed\n");
   }
-  if(wrapper_get_size_to_allocate(24)==32){}
+  if(wrapper_get_size_to_allocate(24)==24 + 2 * HEADER_SIZE){}
   else{
     printf("get min block size when user size is 24 failed\n");
   }
@@ -555,6 +2185,8 @@ void unit_tests(){
   test_malloc_first_fit_case_2(&h_0, &h_1, &h_2);
   initialize_heaps(&h_0, &h_1, &h_2, HEAP_FIRSTFIT);
   test_malloc_first_fit_case_3(&h_0, &h_1, &h_2);
+  initialize_heaps(&h_0, &h_1, &h_2, HEAP_FIRSTFIT);
+  test_side_table_case_1(&h_0, &h_1, &h_2);
 
   // tests: malloc_best_fit
   initialize_heaps(&h_0, &h_1, &h_2, HEAP_BESTFIT);
@@ -577,4 +2209,5 @@ void unit_tests(){
   test_malloc_next_fit_case_3(&h_0, &h_1, &h_2);
   initialize_heaps(&h_0, &h_1, &h_2, HEAP_NEXTFIT);
   test_malloc_next_fit_case_4(&h_0, &h_1, &h_2);
+  release_heaps(&h_0, &h_1, &h_2);
 }
\ No newline at end of file